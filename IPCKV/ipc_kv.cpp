@@ -1,497 +1,3033 @@
 #include "ipc_kv.h"
+#include <chrono>
 
 bool should_crash = false;
 
-IPC_KV::IPC_KV(const std::string& name)
+/**
+* Capacity of a cache holding max_entries keys, or the initial capacity of
+* a store that grows if it is zero.
+*/
+static size_t get_cache_capacity(size_t max_entries)
 {
+	size_t capacity = IPCKV_INITIAL_CAPACITY;
+
+	while ((float)max_entries > (float)capacity * IPCKV_CACHE_FILL)
+		capacity *= 2;
+
+	return capacity;
+}
+
+/**
+* Wall-clock time in milliseconds, what expiry times are kept in.
+*/
+static uint64_t get_time_ms()
+{
+	return uint64_t(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+}
+
+IPC_KV::IPC_KV(const std::string& name, const IPC_KV_Options& options)
+{
+	if (options.m_probing != IPC_KV_Probing::Linear && options.m_probing != IPC_KV_Probing::Triangular)
+		throw std::runtime_error("invalid probing scheme.");
+
 	m_name = name;
+	m_is_observer = options.m_is_observer;
 	m_controller = new IPC_KV_Controller();
+	m_controller->m_name = name;
+	m_controller->m_directory = options.m_directory;
+
+	try
+	{
+		//////////////////////////////////////
+
+		auto needs_recovery = initialize_info(m_name, options);
+
+		//////////////////////////////////////
+
+		{
+			auto& rw_lock = m_controller->m_info->m_lock;
+			auto lock = IPC_Lock(needs_recovery ? IPCKV_WRITE_LOCK : IPCKV_READ_LOCK, &rw_lock, m_controller->m_lock_semaphore);
+
+			map_generations();
+
+			if (needs_recovery)
+			{
+				rw_lock.m_is_abandoned = 0;
+
+				recover();
+			}
+		}
+
+		// Nor do observers recover on opening, see get_lock.
+		if (m_is_observer)
+			wait_for_recovery();
+
+		// Done opening, let the next process open or close.
+		if (m_open_lock != IPCKV_INVALID_HANDLE)
+			ipc_unlock_file(m_open_lock);
+	}
+	catch (...)
+	{
+		delete m_old_controller;
+		delete m_controller;
+
+		m_old_controller = nullptr;
+		m_controller = nullptr;
+
+		release_file_locks();
+
+		throw;
+	}
+} 
+
+IPC_KV::~IPC_KV()
+{
+	close();
+}
+
+/**
+* Maps the info and attaches to it, creating the store if there is none.
+* Returns true if it is a persistent store that has to be recovered.
+*/
+bool IPC_KV::initialize_info(const std::string& name, const IPC_KV_Options& options)
+{
+	auto handle_path = "ipckv_i_" + name;
+
+	if (handle_path.length() > IPCKV_MAX_PATH)
+	{
+		throw std::runtime_error("key is too long.");
+	}
+
+	//////////////////////////////////////////////////
+
+	bool is_persistent = !options.m_directory.empty();
+	bool is_first = false;
+
+	// Processes open and close a persistent store one at a time. Only the
+	// first to attach gets the attach lock exclusively, so it knows that
+	// nobody else has the store open.
+	if (is_persistent)
+	{
+		if (m_open_lock == IPCKV_INVALID_HANDLE)
+		{
+			m_open_lock = ipc_open_lock_file(options.m_directory + "/ipckv_l_" + name);
+
+			if (!m_is_observer)
+				m_attach_lock = ipc_open_lock_file(options.m_directory + "/ipckv_a_" + name);
+
+			if (m_open_lock == IPCKV_INVALID_HANDLE || (!m_is_observer && m_attach_lock == IPCKV_INVALID_HANDLE))
+				throw std::runtime_error("could not open lock file.");
+
+			ipc_lock_file(m_open_lock, true, true);
+		}
+
+		// Observers do not attach, so they must not keep the
+		// next process to attach from knowing it is the first.
+		if (!m_is_observer)
+			is_first = ipc_lock_file(m_attach_lock, true, false);
+	}
+	
+	//////////////////////////////////////////////////
+
+	IPC_Handle info_handle;
+	bool does_already_exist;
+	bool must_exist = options.m_must_exist || m_is_observer;
+
+	auto buffer = m_controller->mapSegment(
+		handle_path,
+		sizeof(IPC_KV_Info),
+		info_handle,
+		does_already_exist,
+		!must_exist
+	);
+
+	if (buffer == nullptr)
+	{
+		throw std::runtime_error(must_exist ? "store does not exist." : "could not map view of file.");
+	}
+
+	//////////////////////////////////////////////////
+
+	auto info = (IPC_KV_Info*)buffer;
+
+	m_controller->m_info = info;
+	m_controller->m_info_handle = info_handle;
+
+	// What lock and event waiters sleep on where there are no futexes.
+	if (m_controller->m_lock_semaphore == IPCKV_INVALID_HANDLE)
+	{
+		m_controller->m_lock_semaphore = ipc_open_semaphore("ipckv_s_" + name);
+		m_controller->m_event_semaphore = ipc_open_semaphore("ipckv_w_" + name);
+	}
+
+	// Left behind by a process that died while creating it.
+	if (does_already_exist && is_first && info->m_hash_policy.load() == 0)
+		does_already_exist = false;
+
+	//////////////////////////////////////////////////
+
+	if (!does_already_exist)
+	{
+		LOG("Initializing info %s...\n", handle_path.c_str());
+
+		info->m_buffer_state = 0;
+
+		m_controller->startInfoTransaction();
+		m_controller->setSize(0);
+		m_controller->setResizeCount(0);
+		m_controller->setCapacity(get_cache_capacity(options.m_max_entries));
+		m_controller->commitInfo();
+
+		info->m_magic = IPCKV_MAGIC;
+		info->m_version = IPCKV_FORMAT_VERSION;
+		info->m_probing = options.m_probing;
+		info->m_is_ordered = options.m_is_ordered;
+		info->m_max_entries = options.m_max_entries;
+		info->m_max_bytes = options.m_max_bytes;
+		info->m_hash_policy.store(IPC_KV_Hash_Policy::id);
+	}
+	else
+	{
+		// The creator might not have set the info up yet.
+		for (int i = 0; info->m_hash_policy.load() == 0; i++)
+		{
+			if (i == IPCKV_MAP_RETRIES)
+				throw std::runtime_error("info is not initialized.");
+
+			ipc_sleep(1);
+		}
+	}
+
+	if (info->m_magic != IPCKV_MAGIC || info->m_version != IPCKV_FORMAT_VERSION)
+		throw std::runtime_error("store format does not match.");
+
+	// Processes hashing keys differently would not find each other's keys.
+	if (info->m_hash_policy.load() != IPC_KV_Hash_Policy::id)
+		throw std::runtime_error("hash policy does not match.");
+
+	//////////////////////////////////////////////////
+
+	bool needs_recovery = false;
+
+	if (is_persistent && !m_is_observer)
+	{
+		if (is_first && does_already_exist)
+		{
+			// Whatever the lock, the attach count and the stats slots
+			// say is left over from processes that are gone.
+			auto& lock = info->m_lock;
+
+			lock.m_next_ticket = 0;
+			lock.m_now_serving = 0;
+			lock.m_writer = 0;
+			lock.m_sleepers = 0;
+			lock.m_is_abandoned = 0;
+
+			for (auto& owner : lock.m_ticket_owners)
+				owner = 0;
+
+			for (auto& slot : lock.m_slots)
+			{
+				slot.m_readers = 0;
+				slot.m_drained = 0;
+			}
+
+			for (auto& slot : info->m_stats)
+				slot.m_process_id = 0;
+
+			info->m_attach_count = 0;
+
+			needs_recovery = !info->m_is_clean.load();
+		}
+
+		info->m_is_clean = 0;
+
+		if (is_first)
+			ipc_unlock_file(m_attach_lock);
+
+		ipc_lock_file(m_attach_lock, false, true);
+	}
+
+	//////////////////////////////////////////////////
+
+	bool is_unlinked;
+
+	{
+		auto lock = IPC_Lock(m_is_observer ? IPCKV_READ_LOCK : IPCKV_WRITE_LOCK, &info->m_lock, m_controller->m_lock_semaphore);
+
+		is_unlinked = ipc_is_unlinked(info_handle);
+
+		if (!is_unlinked && !m_is_observer)
+			info->m_attach_count++;
+	}
+
+	// The last instance detached and unlinked the segment
+	// between us opening and locking it, so start over.
+	if (is_unlinked)
+	{
+		ipc_unmap_shared_memory(m_controller->m_info, sizeof(IPC_KV_Info));
+		ipc_close_handle(m_controller->m_info_handle);
+
+		m_controller->m_info = nullptr;
+		m_controller->m_info_handle = IPCKV_INVALID_HANDLE;
+
+		return initialize_info(name, options);
+	}
+
+	m_resize_count = m_controller->getResizeCount();
+	m_probing = info->m_probing;
+	m_is_ordered = info->m_is_ordered;
+	m_is_cache = info->m_max_entries || info->m_max_bytes;
+
+	// Observers count what they do in the slot shared by
+	// instances that found no slot of their own.
+	if (m_is_observer)
+		m_stats = &info->m_stats[0];
+	else
+		claim_stats_slot();
+
+	return needs_recovery;
+}
+
+/**
+* Takes the first free slot, or one left behind by a process that died
+* without closing, whose counts carry on in the totals.
+*/
+void IPC_KV::claim_stats_slot()
+{
+	auto& slots = m_controller->m_info->m_stats;
+	auto process_id = ipc_get_process_id();
+
+	for (size_t i = 1; i < IPCKV_STATS_SLOTS; i++)
+	{
+		auto owner = slots[i].m_process_id.load();
+
+		// Other instances of ours are still using theirs.
+		if (owner != 0 && (owner == process_id || ipc_is_process_alive(owner)))
+			continue;
+
+		if (slots[i].m_process_id.compare_exchange_strong(owner, process_id))
+		{
+			m_stats = &slots[i];
+
+			return;
+		}
+	}
+
+	m_stats = &slots[0];
+}
+
+std::tuple<uint8_t*, IPC_Handle, size_t> IPC_KV::initialize_data(const std::string& name, size_t capacity, size_t resize_count)
+{
+	auto allocation_size = IPC_KV_Controller::getMappingSize(capacity);
+
+	///////////////////////////////////////////
+
+	auto handle_path = get_data_name(name, resize_count);
+
+	if (handle_path.length() > IPCKV_MAX_PATH)
+	{
+		throw std::runtime_error("key is too long."); 
+	}
+
+	///////////////////////////////////////////
+
+	IPC_Handle data_handle;
+	bool does_already_exist;
+
+	auto buffer = m_controller->mapSegment(
+		handle_path,
+		allocation_size,
+		data_handle,
+		does_already_exist
+	);
+
+	if (buffer == nullptr)
+	{
+		throw std::runtime_error("could not map view of file.");
+	} 
+
+	///////////////////////////////////////////
+
+	// New mappings come zeroed from the system, which leaves every slot empty.
+	// Touching them here would fault in the whole generation up front.
+	if (!does_already_exist)
+	{
+		LOG("Initializing data %s...\n", handle_path.c_str());
+	}
+
+	return std::make_tuple((uint8_t*)buffer, data_handle, allocation_size);
+}
+
+std::string IPC_KV::get_data_name(const std::string& name, size_t resize_count)
+{
+	return "ipckv_" + std::to_string(resize_count) + "_" + name;
+}
+
+void IPC_KV::close()
+{
+	if (m_controller) 
+	{
+		// Observers never attached, so they leave the store as it is.
+		if (!m_is_observer)
+		{
+			// Persistent stores are opened and closed one process at a time.
+			if (m_open_lock != IPCKV_INVALID_HANDLE)
+				ipc_lock_file(m_open_lock, true, true);
+
+			auto lock = get_lock(IPCKV_WRITE_LOCK);
+
+			if (m_stats != &m_controller->m_info->m_stats[0])
+				m_stats->m_process_id.store(0);
+
+			m_stats = nullptr;
+
+			if (--m_controller->m_info->m_attach_count == 0)
+			{
+				if (!m_controller->m_directory.empty())
+				{
+					LOG("Flushing %s...\n", m_name.c_str());
+
+					flush();
+				}
+				else
+				{
+					LOG("Unlinking %s...\n", m_name.c_str());
+
+					m_controller->unlinkSegment("ipckv_i_" + m_name);
+					m_controller->unlinkSegment(get_data_name(m_name, m_resize_count));
+
+					if (m_old_controller)
+						m_controller->unlinkSegment(get_data_name(m_name, m_resize_count - 1));
+
+					auto chunk_count = m_controller->m_info->m_heap.m_chunk_count.load();
+
+					for (size_t i = 0; i < chunk_count; i++)
+						m_controller->unlinkSegment(m_controller->getChunkName(i));
+				}
+			}
+		}
+
+		delete m_old_controller;
+		delete m_controller;
+
+		m_old_controller = nullptr;
+		m_controller = nullptr;
+
+		release_file_locks();
+	}
+}
+
+/**
+* Writes every segment of a persistent store back to its file and then
+* marks the store as cleanly closed.
+*/
+void IPC_KV::flush()
+{
+	auto info = m_controller->m_info;
+
+	for (auto controller : { m_old_controller, m_controller })
+	{
+		if (controller)
+			ipc_flush_mapping(controller->m_control, controller->m_data_size);
+	}
+
+	auto chunk_count = info->m_heap.m_chunk_count.load();
+
+	for (size_t i = 0; i < chunk_count; i++)
+	{
+		auto chunk = m_controller->getChunk(i);
+
+		if (chunk)
+			ipc_flush_mapping(chunk->m_buffer, chunk->m_size);
+	}
+
+	ipc_flush_mapping(info, sizeof(IPC_KV_Info));
+
+	info->m_is_clean = 1;
+
+	ipc_flush_mapping(info, sizeof(IPC_KV_Info));
+}
+
+void IPC_KV::release_file_locks()
+{
+	// The attach lock goes first, the next process to open
+	// must not find it held by an instance that is closed.
+	for (auto handle : { &m_attach_lock, &m_open_lock })
+	{
+		if (*handle == IPCKV_INVALID_HANDLE)
+			continue;
+
+		ipc_unlock_file(*handle);
+		ipc_close_handle(*handle);
+
+		*handle = IPCKV_INVALID_HANDLE;
+	}
+}
+
+/**
+* Brings a persistent store left behind by a crash back to a consistent
+* state, called with the write lock held by the first process to attach.
+* Slots are double-buffered and committed at once, so what can be off is
+* whatever a writer had not got to: control bytes, counts, duplicates of a
+* key halfway through moving generations, generations halfway through being
+* created or unlinked, and the free lists.
+*/
+void IPC_KV::recover()
+{
+	LOG("Recovering %s...\n", m_name.c_str());
+
+	auto info = m_controller->m_info;
+
+	// Generations that were being created or were not unlinked yet.
+	m_controller->unlinkSegment(get_data_name(m_name, m_resize_count + 1));
+
+	if (m_resize_count >= 2)
+		m_controller->unlinkSegment(get_data_name(m_name, m_resize_count - 2));
+
+	if (!m_old_controller && m_resize_count >= 1)
+		m_controller->unlinkSegment(get_data_name(m_name, m_resize_count - 1));
+
+	//////////////////////////////////////////
+
+	size_t size = 0;
+	size_t tombstones = 0;
+	uint64_t version = 0;
+
+	std::vector<uint64_t> references;
+
+	for (auto controller : { m_controller, m_old_controller })
+	{
+		if (!controller)
+			continue;
+
+		for (size_t i = 0; i < controller->getDataCapacity(); i++)
+		{
+			if (controller->getDataState(i) == IPC_KV_Data_State::Occupied)
+			{
+				// A block that does not hold together, or a key that already
+				// made it to the current generation, is dropped. The block is
+				// left alone, the heap is rebuilt from the slots below.
+				bool is_dropped = !controller->isValidBlock(controller->getDataBlock(i))
+					|| (controller == m_old_controller && find_bucket(m_controller, std::string(controller->getDataKey(i)), controller->getDataHash(i)) != SIZE_MAX);
+
+				if (is_dropped)
+				{
+					controller->startDataTransaction(i);
+					controller->setDataState(i, IPC_KV_Data_State::Deleted);
+					controller->setDataBlock(i, 0);
+					controller->commitData(i, false);
+				}
+			}
+
+			auto state = controller->repairControl(i);
+
+			if (state == IPC_KV_Data_State::Occupied)
+			{
+				size++;
+				version = std::max(version, controller->getDataVersion(i));
+				references.push_back(controller->getDataBlock(i));
+			}
+			else if (state == IPC_KV_Data_State::Deleted && controller == m_controller)
+			{
+				tombstones++;
+			}
+		}
+	}
+
+	if (m_controller->getSize() != size)
+	{
+		m_controller->startInfoTransaction();
+		m_controller->setSize(size);
+		m_controller->commitInfo();
+	}
+
+	info->m_tombstones = tombstones;
+
+	// A write can have committed without publishing its event, whose
+	// version must not be handed out again.
+	if (info->m_events.m_head.load() < version)
+		info->m_events.m_head = version;
+
+	if (m_old_controller)
+		info->m_migrate_index = std::min(info->m_migrate_index, m_old_controller->getDataCapacity());
+
+	//////////////////////////////////////////
+
+	// Every block from the start of the heap up to where it is being carved
+	// has a header, so walking them puts back on the free lists exactly
+	// those no slot references.
+	std::sort(references.begin(), references.end());
+
+	auto& heap = info->m_heap;
+	uint64_t live_bytes = 0;
+
+	std::fill(std::begin(heap.m_free), std::end(heap.m_free), 0);
+
+	auto chunk_count = std::min<uint64_t>(heap.m_chunk_count.load(), heap.m_chunk_current + 1);
+
+	for (uint64_t chunk = 0; chunk < chunk_count; chunk++)
+	{
+		auto limit = chunk < heap.m_chunk_current ? heap.m_chunk_size[chunk] : heap.m_chunk_used;
+
+		for (uint64_t offset = 0; offset < limit;)
+		{
+			uint64_t reference = ((chunk + 1) << IPCKV_HEAP_CHUNK_SHIFT) | offset;
+			auto block = m_controller->getBlock(reference);
+
+			if (block->m_size_class >= IPCKV_HEAP_CLASSES)
+				break;
+
+			uint64_t block_size = 1ull << (block->m_size_class + IPCKV_HEAP_MIN_SHIFT);
+
+			if (offset + block_size > limit)
+				break;
+
+			if (std::binary_search(references.begin(), references.end(), reference))
+			{
+				live_bytes += block_size;
+			}
+			else
+			{
+				block->m_next = heap.m_free[block->m_size_class];
+				heap.m_free[block->m_size_class] = reference;
+			}
+
+			offset += block_size;
+		}
+	}
+
+	heap.m_live_bytes = live_bytes;
+
+	//////////////////////////////////////////
+
+	// Index nodes went back on the free lists with the rest of the
+	// blocks no slot references, so the index is built again.
+	if (m_is_ordered)
+	{
+		m_controller->resetIndex();
+
+		for (auto controller : { m_controller, m_old_controller })
+		{
+			if (!controller)
+				continue;
+
+			for (size_t i = 0; i < controller->getDataCapacity(); i++)
+			{
+				if (controller->getDataState(i) != IPC_KV_Data_State::Occupied)
+					continue;
+
+				auto node = m_controller->createIndexNode(std::string(controller->getDataKey(i)), controller->getDataHash(i));
+
+				m_controller->insertIndexNode(node);
+			}
+		}
+	}
+}
+
+/**
+* Rather than deleting every key, switches to a fresh generation of the same
+* capacity and frees the whole heap. Attached instances move over on their
+* next lock, lock-free lookups in the abandoned generation notice the resize
+* count change and retry.
+*/
+void IPC_KV::clear()
+{
+	auto lock = get_lock(IPCKV_WRITE_LOCK);
+
+	switch_generation(m_controller->getCapacity());
+}
+
+/**
+* Empties the store by switching to a fresh generation of capacity slots,
+* see clear. Must be called with the write lock held.
+*/
+void IPC_KV::switch_generation(size_t capacity)
+{
+	auto new_resize_count = m_controller->getResizeCount() + 1;
+
+	auto new_data_tuple = initialize_data(m_name, capacity, new_resize_count);
+
+	m_controller->startInfoTransaction();
+	m_controller->setSize(0);
+	m_controller->setCapacity(capacity);
+	m_controller->setResizeCount(new_resize_count);
+	m_controller->setOldCapacity(0);
+	m_controller->commitInfo();
+
+	m_controller->m_info->m_migrate_index = 0;
+	m_controller->m_info->m_sweep_index = 0;
+	m_controller->m_info->m_clock_hand = 0;
+	m_controller->m_info->m_tombstones = 0;
+	m_controller->m_info->m_has_expiry = false;
+
+	m_controller->resetHeap();
+	m_controller->resetIndex();
+	m_controller->publishEvent(EventClear, 0);
+
+	//////////////////////////////////////////
+
+	if (m_old_controller)
+	{
+		m_controller->unlinkSegment(get_data_name(m_name, m_resize_count - 1));
+
+		delete m_old_controller;
+
+		m_old_controller = nullptr;
+	}
+
+	ipc_unmap_shared_memory(m_controller->m_control, m_controller->m_data_size);
+	ipc_close_handle(m_controller->m_data_handle);
+
+	m_controller->setDataMapping(std::get<0>(new_data_tuple), std::get<1>(new_data_tuple), capacity);
+
+	m_controller->unlinkSegment(get_data_name(m_name, m_resize_count));
+
+	m_resize_count = new_resize_count;
+}
+
+void IPC_KV::snapshot(const std::string& path)
+{
+	for (int attempt = 0; ; attempt++)
+	{
+		// Reopening truncates whatever an attempt cut short left behind.
+		auto file = ipc_open_file(path, "wb");
+
+		if (!file)
+			throw std::runtime_error("could not open snapshot file.");
+
+		bool is_complete;
+
+		try
+		{
+			is_complete = write_snapshot(file, attempt < IPCKV_SNAPSHOT_RETRIES ? IPCKV_SNAPSHOT_BATCH : SIZE_MAX);
+		}
+		catch (...)
+		{
+			fclose(file);
+
+			throw;
+		}
+
+		if (fclose(file) != 0)
+			throw std::runtime_error("could not write snapshot file.");
+
+		if (is_complete)
+			return;
+
+		LOG("Snapshot cut short by a resize, starting over.\n");
+	}
+}
+
+/**
+* Writes the snapshot a batch of slots per read lock, or all of it under one
+* if batch_size is SIZE_MAX. Returns false if a resize or clear happened
+* between batches, which moves keys around so the walk has to start over.
+*/
+bool IPC_KV::write_snapshot(FILE* file, size_t batch_size)
+{
+	IPC_KV_Snapshot_Header header = { IPCKV_SNAPSHOT_MAGIC, IPCKV_SNAPSHOT_VERSION, 0, 0 };
+
+	if (fwrite(&header, sizeof(header), 1, file) != 1)
+		throw std::runtime_error("could not write snapshot file.");
+
+	std::vector<unsigned char> buffer;
+
+	if (batch_size == SIZE_MAX)
+	{
+		auto lock = get_lock(IPCKV_READ_LOCK);
+
+		if (m_old_controller)
+			write_snapshot_records(m_old_controller, 0, m_old_controller->getDataCapacity(), buffer, header, nullptr);
+
+		write_snapshot_records(m_controller, 0, m_controller->getDataCapacity(), buffer, header, nullptr);
+	}
+	else
+	{
+		size_t resize_count = SIZE_MAX;
+		bool is_old = false;
+		bool is_done = false;
+
+		// Like scan, the old generation of an ongoing migration is walked
+		// first, so that keys migrated meanwhile are found in the current
+		// one. Those migrated from the part already walked are found there
+		// again and are told apart by their version.
+		std::vector<uint64_t> old_versions;
+
+		auto finish_old = [&]() {
+			std::sort(old_versions.begin(), old_versions.end());
+
+			is_old = false;
+		};
+
+		for (size_t index = 0; !is_done;)
+		{
+			buffer.clear();
+
+			{
+				auto lock = get_lock(IPCKV_READ_LOCK);
+
+				if (resize_count == SIZE_MAX)
+				{
+					resize_count = m_resize_count;
+					is_old = m_old_controller != nullptr;
+				}
+				else if (m_resize_count != resize_count)
+				{
+					return false;
+				}
+
+				// Migration finished, everything left moved to the current generation.
+				if (is_old && !m_old_controller)
+				{
+					finish_old();
+
+					index = 0;
+				}
+
+				auto controller = is_old ? m_old_controller : m_controller;
+				auto capacity = controller->getDataCapacity();
+
+				auto end = index + std::min(batch_size, capacity - index);
+
+				write_snapshot_records(controller, index, end, buffer, header, &old_versions);
+
+				index = end;
+
+				if (index == capacity)
+				{
+					if (is_old)
+						finish_old();
+					else
+						is_done = true;
+
+					index = 0;
+				}
+			}
+
+			if (buffer.size() && fwrite(buffer.data(), buffer.size(), 1, file) != 1)
+				throw std::runtime_error("could not write snapshot file.");
+		}
+
+		buffer.clear();
+	}
+
+	if (buffer.size() && fwrite(buffer.data(), buffer.size(), 1, file) != 1)
+		throw std::runtime_error("could not write snapshot file.");
+
+	if (fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, file) != 1)
+		throw std::runtime_error("could not write snapshot file.");
+
+	return true;
+}
+
+/**
+* Appends the records of slots begin to end to buffer. Unless old_versions
+* is nullptr, the old generation adds the versions of its records to it and
+* the current one skips those it holds, sorted by then.
+*/
+void IPC_KV::write_snapshot_records(IPC_KV_Controller* controller, size_t begin, size_t end, std::vector<unsigned char>& buffer, IPC_KV_Snapshot_Header& header, std::vector<uint64_t>* old_versions)
+{
+	auto now = get_time_ms();
+
+	for (size_t i = begin; i < end; i++)
+	{
+		if (controller->getDataState(i) != IPC_KV_Data_State::Occupied)
+			continue;
+
+		uint64_t expiry = controller->getDataExpiry(i);
+
+		if (expiry && expiry <= now)
+			continue;
+
+		if (old_versions)
+		{
+			auto version = controller->getDataVersion(i);
+
+			if (controller == m_old_controller)
+				old_versions->push_back(version);
+			else if (std::binary_search(old_versions->begin(), old_versions->end(), version))
+				continue;
+		}
+
+		auto key = controller->getDataKey(i);
+		auto data = controller->getData(i);
+		uint32_t key_size = uint32_t(key.size());
+		uint64_t value_size = controller->getDataSize(i);
+
+		auto offset = buffer.size();
+
+		buffer.resize(offset + IPCKV_SNAPSHOT_RECORD_PREFIX + key_size + value_size);
+
+		auto record = buffer.data() + offset;
+
+		std::memcpy(record, &key_size, sizeof(key_size));
+		std::memcpy(record + sizeof(key_size), &value_size, sizeof(value_size));
+		std::memcpy(record + sizeof(key_size) + sizeof(value_size), &expiry, sizeof(expiry));
+		std::memcpy(record + IPCKV_SNAPSHOT_RECORD_PREFIX, key.data(), key_size);
+		std::memcpy(record + IPCKV_SNAPSHOT_RECORD_PREFIX + key_size, data, value_size);
+
+		header.m_checksum = ipc_wyhash::hash(record, buffer.size() - offset, header.m_checksum);
+		header.m_count++;
+	}
+}
+
+std::vector<std::pair<std::string, std::string>> IPC_KV::scan(IPC_KV_Cursor& cursor, size_t count)
+{
+	std::vector<std::pair<std::string, std::string>> entries;
+
+	if (cursor.m_is_done)
+		return entries;
+
+	auto lock = get_lock(IPCKV_READ_LOCK);
+
+	if (cursor.m_resize_count != m_resize_count)
+	{
+		// A resize made the generation being walked the old one, its keys
+		// either stay where they are or move to the current one, which is
+		// walked in full afterwards. Anything else starts over.
+		if (cursor.m_resize_count != SIZE_MAX && cursor.m_resize_count + 1 == m_resize_count && !cursor.m_is_old && m_old_controller)
+		{
+			cursor.m_is_old = true;
+		}
+		else
+		{
+			cursor.m_index = 0;
+			cursor.m_is_old = m_old_controller != nullptr;
+		}
+
+		cursor.m_resize_count = m_resize_count;
+	}
+	else if (cursor.m_is_old && !m_old_controller)
+	{
+		// Migration finished, everything left moved to the current generation.
+		cursor.m_index = 0;
+		cursor.m_is_old = false;
+	}
+
+	//////////////////////////////////////////
+
+	for (size_t visited = 0; visited < count;)
+	{
+		auto controller = cursor.m_is_old ? m_old_controller : m_controller;
+		auto capacity = controller->getDataCapacity();
+
+		if (cursor.m_index >= capacity)
+		{
+			if (!cursor.m_is_old)
+			{
+				cursor.m_is_done = true;
+
+				break;
+			}
+
+			cursor.m_index = 0;
+			cursor.m_is_old = false;
+
+			continue;
+		}
+
+		auto& index = cursor.m_index;
+
+		for (; index < capacity && visited < count; index++, visited++)
+		{
+			if (controller->getDataState(index) != IPC_KV_Data_State::Occupied || is_expired(controller, index))
+				continue;
+
+			auto key = controller->getDataKey(index);
+
+			entries.emplace_back(
+				std::string(key),
+				std::string((const char*)controller->getData(index), controller->getDataSize(index))
+			);
+		}
+	}
+
+	return entries;
+}
+
+std::vector<std::pair<std::string, std::string>> IPC_KV::range(const std::string& begin, const std::string& end, size_t limit)
+{
+	return walk_index(begin, [&](std::string_view key) { return key < end; }, limit);
+}
+
+std::vector<std::pair<std::string, std::string>> IPC_KV::prefix(const std::string& prefix, size_t limit)
+{
+	return walk_index(prefix, [&](std::string_view key) { return key.substr(0, prefix.length()) == prefix; }, limit);
+}
+
+/**
+* Collects the keys from begin on for as long as is_within holds, along with
+* their values, which are looked up in the table.
+*/
+std::vector<std::pair<std::string, std::string>> IPC_KV::walk_index(const std::string& begin, const std::function<bool(std::string_view)>& is_within, size_t limit)
+{
+	if (!m_is_ordered)
+		throw std::runtime_error("store is not ordered.");
+
+	std::vector<std::pair<std::string, std::string>> entries;
+
+	auto lock = get_lock(IPCKV_READ_LOCK);
+
+	for (auto node = m_controller->seekIndex(begin); node && entries.size() < limit; node = m_controller->getIndexNext(node))
+	{
+		auto key = m_controller->getIndexKey(node);
+
+		if (!is_within(key))
+			break;
+
+		std::string key_string(key);
+		uint64_t hashCode = hash(key_string.c_str(), key_string.length());
+
+		for (auto controller : { m_controller, m_old_controller })
+		{
+			if (!controller)
+				continue;
+
+			size_t bucket = find_bucket(controller, key_string, hashCode);
+
+			if (bucket == SIZE_MAX)
+				continue;
+
+			if (is_expired(controller, bucket))
+				break;
+
+			entries.emplace_back(
+				std::move(key_string),
+				std::string((const char*)controller->getData(bucket), controller->getDataSize(bucket))
+			);
+
+			break;
+		}
+	}
+
+	return entries;
+}
+
+/**
+* Builds the table in one pass, at a capacity that holds every entry of the
+* snapshot without resizing. A snapshot that turns out to be corrupt leaves
+* the store empty.
+*/
+void IPC_KV::load(const std::string& path)
+{
+	auto file = ipc_open_file(path, "rb");
+
+	if (!file)
+		throw std::runtime_error("could not open snapshot file.");
+
+	IPC_KV_Snapshot_Header header;
+
+	if (fread(&header, sizeof(header), 1, file) != 1 || header.m_magic != IPCKV_SNAPSHOT_MAGIC || header.m_version != IPCKV_SNAPSHOT_VERSION)
+	{
+		fclose(file);
+
+		throw std::runtime_error("snapshot format does not match.");
+	}
+
+	// Every record takes at least its prefix, which keeps a corrupt count
+	// from sizing the table for more entries than the file could hold.
+	fseek(file, 0, SEEK_END);
+
+	auto file_size = uint64_t(ftell(file));
+
+	fseek(file, sizeof(header), SEEK_SET);
+
+	if (header.m_count > (file_size - sizeof(header)) / IPCKV_SNAPSHOT_RECORD_PREFIX)
+	{
+		fclose(file);
+
+		throw std::runtime_error("snapshot is corrupt.");
+	}
+
+	size_t capacity = IPCKV_INITIAL_CAPACITY;
+
+	while ((float)header.m_count / (float)capacity >= IPCKV_MAX_LOAD_FACTOR)
+		capacity *= 2;
+
+	// A cache keeps its size and evicts whatever does not fit.
+	if (m_controller->m_info->m_max_entries)
+		capacity = get_cache_capacity(m_controller->m_info->m_max_entries);
+
+	//////////////////////////////////////////
+
+	auto lock = get_lock(IPCKV_WRITE_LOCK);
+
+	switch_generation(capacity);
+
+	std::vector<unsigned char> record;
+	uint64_t checksum = 0;
+	bool is_valid = true;
+
+	// What a failed load leaves behind, an empty store
+	// of the capacity it was created with.
+	auto empty_capacity = get_cache_capacity(m_controller->m_info->m_max_entries);
+
+	auto now = get_time_ms();
+
+	try
+	{
+		for (uint64_t i = 0; i < header.m_count && is_valid; i++)
+		{
+			uint32_t key_size;
+			uint64_t value_size;
+			uint64_t expiry;
+
+			record.resize(IPCKV_SNAPSHOT_RECORD_PREFIX);
+
+			if (fread(record.data(), IPCKV_SNAPSHOT_RECORD_PREFIX, 1, file) != 1)
+			{
+				is_valid = false;
+				break;
+			}
+
+			std::memcpy(&key_size, record.data(), sizeof(key_size));
+			std::memcpy(&value_size, record.data() + sizeof(key_size), sizeof(value_size));
+			std::memcpy(&expiry, record.data() + sizeof(key_size) + sizeof(value_size), sizeof(expiry));
+
+			if (key_size >= IPCKV_KEY_SIZE - 1 || value_size > IPCKV_DATA_SIZE)
+			{
+				is_valid = false;
+				break;
+			}
+
+			record.resize(IPCKV_SNAPSHOT_RECORD_PREFIX + key_size + value_size);
+
+			if (key_size + value_size && fread(record.data() + IPCKV_SNAPSHOT_RECORD_PREFIX, key_size + value_size, 1, file) != 1)
+			{
+				is_valid = false;
+				break;
+			}
+
+			checksum = ipc_wyhash::hash(record.data(), record.size(), checksum);
+
+			// Expired since the snapshot was taken.
+			if (expiry && expiry <= now)
+				continue;
+
+			std::string key((const char*)record.data() + IPCKV_SNAPSHOT_RECORD_PREFIX, key_size);
+
+			// Goes the way of set, so that a cache evicts as it fills
+			// and the size is right after every entry.
+			store(key, hash(key.c_str(), key.length()), record.data() + IPCKV_SNAPSHOT_RECORD_PREFIX + key_size, value_size, expiry);
+		}
+	}
+	catch (...)
+	{
+		fclose(file);
+
+		switch_generation(empty_capacity);
+
+		throw;
+	}
+
+	fclose(file);
+
+	if (!is_valid || checksum != header.m_checksum)
+	{
+		switch_generation(empty_capacity);
+
+		throw std::runtime_error("snapshot is corrupt.");
+	}
+}
+
+bool IPC_KV::remove(const std::string& key)
+{
+	auto lock = get_lock(IPCKV_WRITE_LOCK);
+
+	auto is_removed = erase(key, hash(key.c_str(), key.length()));
+
+	IPC_KV_Stats_Slot::add(m_stats->m_removes);
+
+	if (is_removed)
+	{
+		m_controller->startInfoTransaction();
+		m_controller->setSize(m_controller->getSize() - 1);
+		m_controller->commitInfo();
+	}
+
+	migrate(get_migrate_count(0));
+	sweep_buckets(IPCKV_SWEEP_BUCKETS);
+
+	return is_removed;
+}
+
+size_t IPC_KV::multi_remove(const std::vector<std::string>& keys)
+{
+	std::vector<uint64_t> hashCodes;
+	hashCodes.reserve(keys.size());
+
+	for (auto& key : keys)
+		hashCodes.push_back(hash(key.c_str(), key.length()));
+
+	//////////////////////////////////////////
+
+	auto lock = get_lock(IPCKV_WRITE_LOCK);
+
+	prefetch(hashCodes);
+
+	size_t removed = 0;
+
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		if (erase(keys[i], hashCodes[i]))
+			removed++;
+
+		migrate(get_migrate_count(0));
+		sweep_buckets(IPCKV_SWEEP_BUCKETS);
+	}
+
+	if (removed)
+	{
+		m_controller->startInfoTransaction();
+		m_controller->setSize(m_controller->getSize() - removed);
+		m_controller->commitInfo();
+	}
+
+	IPC_KV_Stats_Slot::add(m_stats->m_removes, keys.size());
+
+	return removed;
+}
+
+/**
+* Takes key out of whichever generation holds it, leaving the size to the caller.
+*/
+bool IPC_KV::erase(const std::string& key, uint64_t hashCode)
+{
+	IPC_KV_Controller* controller;
+
+	// An expired key was as good as gone already.
+	size_t bucket = find_live_bucket(key, hashCode, controller);
+
+	if (bucket == SIZE_MAX)
+		return false;
+
+	remove_slot(controller, bucket, EventRemove);
+
+	return true;
+}
+
+/**
+* Deletes the key in a slot, leaving the size to the caller, and
+* tells watchers why.
+*/
+void IPC_KV::remove_slot(IPC_KV_Controller* controller, size_t bucket, IPC_KV_Event_Type type)
+{
+	if (m_is_ordered)
+		m_controller->removeIndexKey(controller->getDataKey(bucket));
+
+	auto hashCode = controller->getDataHash(bucket);
+
+	controller->startDataTransaction(bucket);
+	controller->setDataState(bucket, IPC_KV_Data_State::Deleted);
+	controller->setDataBlock(bucket, 0);
+	controller->setDataExpiry(bucket, 0);
+	controller->commitData(bucket);
+	controller->setControl(bucket, IPCKV_CONTROL_DELETED);
+
+	if (controller == m_controller)
+		m_controller->m_info->m_tombstones++;
+
+	// Published once the key is gone, as sets are once it is there,
+	// so a watcher looking it up finds what the event says.
+	m_controller->publishEvent(type, hashCode);
+}
+
+/**
+* Deletes a key that expired, which counted towards the size until now.
+*/
+void IPC_KV::expire(IPC_KV_Controller* controller, size_t bucket)
+{
+	remove_slot(controller, bucket, EventExpire);
+
+	m_controller->startInfoTransaction();
+	m_controller->setSize(m_controller->getSize() - 1);
+	m_controller->commitInfo();
+
+	IPC_KV_Stats_Slot::add(m_stats->m_expirations);
+}
+
+bool IPC_KV::is_expired(IPC_KV_Controller* controller, size_t bucket)
+{
+	if (!m_controller->m_info->m_has_expiry)
+		return false;
+
+	auto expiry = controller->getDataExpiry(bucket);
+
+	return expiry && expiry <= get_time_ms();
+}
+
+/**
+* Evicts keys until key, with a block of bytes, fits within the limits of
+* a cache. Overwriting a key takes no slot of its own and only the bytes
+* the new block has over the old one.
+*/
+void IPC_KV::make_room(const std::string& key, uint64_t hashCode, size_t bytes)
+{
+	auto info = m_controller->m_info;
+
+	IPC_KV_Controller* controller;
+	auto bucket = find_live_bucket(key, hashCode, controller);
+	size_t pending = 1;
+
+	if (bucket != SIZE_MAX)
+	{
+		pending = 0;
+		bytes -= std::min(bytes, sizeof(IPC_KV_Block) + key.length() + controller->getDataSize(bucket));
+	}
+
+	while (
+		(info->m_max_entries && m_controller->getSize() + pending > info->m_max_entries)
+		|| (info->m_max_bytes && info->m_heap.m_live_bytes.load() + bytes > info->m_max_bytes)
+		)
+	{
+		if (!evict())
+			break;
+	}
+}
+
+/**
+* Deletes a key to make room in a cache, see evict_generation. Keys still in
+* the old generation of a migration have not been written since the resize,
+* so they go first, instead of pushing the whole migration through and
+* leaving only the keys written since to the CLOCK.
+*/
+bool IPC_KV::evict()
+{
+	if (m_old_controller && evict_generation(m_old_controller, m_controller->m_info->m_migrate_index))
+		return true;
+
+	return evict_generation(m_controller, 0);
+}
+
+/**
+* Moves the CLOCK hand over the slots of a generation from begin on,
+* clearing the reference bytes it passes, and deletes the first key it
+* finds one clear for, or an expired key. Returns false if there was
+* nothing to delete.
+*/
+bool IPC_KV::evict_generation(IPC_KV_Controller* controller, size_t begin)
+{
+	auto capacity = controller->getDataCapacity();
+	auto& hand = m_controller->m_info->m_clock_hand;
+
+	// All bytes are clear after one round, so two find a key if there is one.
+	for (size_t i = 0; i < (capacity - begin) * 2; i++, hand++)
+	{
+		if (hand < begin || hand >= capacity)
+			hand = begin;
+
+		if (controller->getDataState(hand) != IPC_KV_Data_State::Occupied)
+			continue;
+
+		if (is_expired(controller, hand))
+		{
+			expire(controller, hand++);
+
+			return true;
+		}
+
+		if (controller->m_reference[hand].load(std::memory_order_relaxed))
+		{
+			controller->m_reference[hand].store(0, std::memory_order_relaxed);
+
+			continue;
+		}
+
+		remove_slot(controller, hand++, EventEvict);
+
+		m_controller->startInfoTransaction();
+		m_controller->setSize(m_controller->getSize() - 1);
+		m_controller->commitInfo();
+
+		IPC_KV_Stats_Slot::add(m_stats->m_evictions);
+
+		return true;
+	}
+
+	return false;
+}
+
+size_t IPC_KV::sweep(size_t count)
+{
+	auto lock = get_lock(IPCKV_WRITE_LOCK);
+
+	return sweep_buckets(count);
+}
+
+/**
+* Moves the sweep on by count slots of the current generation, wrapping
+* around. The old generation is left to migration, which drops expired
+* keys instead of moving them.
+*/
+size_t IPC_KV::sweep_buckets(size_t count)
+{
+	auto info = m_controller->m_info;
+
+	if (!info->m_has_expiry)
+		return 0;
+
+	auto now = get_time_ms();
+	auto capacity = m_controller->getDataCapacity();
+	auto& index = info->m_sweep_index;
+
+	size_t expired = 0;
+
+	for (size_t i = 0; i < std::min(count, capacity); i++, index++)
+	{
+		index &= capacity - 1;
+
+		if (m_controller->getDataState(index) != IPC_KV_Data_State::Occupied)
+			continue;
+
+		auto expiry = m_controller->getDataExpiry(index);
+
+		if (expiry && expiry <= now)
+		{
+			expire(m_controller, index);
+			expired++;
+		}
+	}
+
+	return expired;
+}
+
+bool IPC_KV::get(const std::string& key, unsigned char* data, size_t & size)
+{
+	uint64_t version;
+
+	return get(key, data, size, version);
+}
+
+bool IPC_KV::get(const std::string& key, unsigned char* data, size_t& size, uint64_t& version)
+{
+	uint64_t hashCode = hash(key.c_str(), key.length());
+	size_t capacity = size;
+
+	while (true)
+	{
+		// Generations only change under the write lock, so
+		// taking the read lock is enough to remap safely.
+		if (
+			m_resize_count != m_controller->getResizeCount()
+			|| (m_old_controller && !m_controller->getOldCapacity())
+			)
+		{
+			auto lock = get_lock(IPCKV_READ_LOCK);
+		}
+
+		auto resize_count = m_resize_count;
+
+		size = capacity;
+
+		// Migration inserts into the new generation before deleting from 
+		// the old one, so looking in the old one first never misses a key.
+		auto is_found = (m_old_controller && find(m_old_controller, key, hashCode, data, size, version))
+			|| find(m_controller, key, hashCode, data, size, version);
+
+		// A resize committed while we were probing the
+		// old generation, so the result may be stale.
+		if (resize_count != m_controller->getResizeCount())
+			continue;
+
+		IPC_KV_Stats_Slot::add(m_stats->m_gets);
+		IPC_KV_Stats_Slot::add(is_found ? m_stats->m_hits : m_stats->m_misses);
+
+		if (is_found && size > capacity)
+			throw std::runtime_error("buffer is too small.");
+
+		return is_found;
+	}
+}
+
+IPC_KV_View IPC_KV::get_view(const std::string& key)
+{
+	auto lock = get_lock(IPCKV_READ_LOCK);
+
+	uint64_t hashCode = hash(key.c_str(), key.length());
+
+	for (auto controller : { m_old_controller, m_controller })
+	{
+		if (!controller)
+			continue;
+
+		size_t bucket = find_bucket(controller, key, hashCode);
+
+		if (bucket != SIZE_MAX && is_expired(controller, bucket))
+			break;
+
+		if (bucket != SIZE_MAX)
+		{
+			if (m_is_cache)
+				controller->touchData(bucket);
+
+			IPC_KV_Stats_Slot::add(m_stats->m_gets);
+			IPC_KV_Stats_Slot::add(m_stats->m_hits);
+
+			return IPC_KV_View(
+				std::move(lock), 
+				controller->getData(bucket), 
+				controller->getDataSize(bucket)
+			);
+		}
+	}
+
+	IPC_KV_Stats_Slot::add(m_stats->m_gets);
+	IPC_KV_Stats_Slot::add(m_stats->m_misses);
+
+	return IPC_KV_View();
+}
+
+size_t IPC_KV::multi_get(const std::vector<std::string>& keys, const std::function<void(size_t, const unsigned char*, size_t)>& callback)
+{
+	std::vector<uint64_t> hashCodes;
+	hashCodes.reserve(keys.size());
+
+	for (auto& key : keys)
+		hashCodes.push_back(hash(key.c_str(), key.length()));
+
+	//////////////////////////////////////////
+
+	auto lock = get_lock(IPCKV_READ_LOCK);
+
+	prefetch(hashCodes);
+
+	size_t found = 0;
+
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		for (auto controller : { m_old_controller, m_controller })
+		{
+			if (!controller)
+				continue;
+
+			size_t bucket = find_bucket(controller, keys[i], hashCodes[i]);
+
+			if (bucket == SIZE_MAX)
+				continue;
+
+			if (!is_expired(controller, bucket))
+			{
+				if (m_is_cache)
+					controller->touchData(bucket);
+
+				callback(i, controller->getData(bucket), controller->getDataSize(bucket));
+				found++;
+			}
+
+			break;
+		}
+	}
+
+	IPC_KV_Stats_Slot::add(m_stats->m_gets, keys.size());
+	IPC_KV_Stats_Slot::add(m_stats->m_hits, found);
+	IPC_KV_Stats_Slot::add(m_stats->m_misses, keys.size() - found);
+
+	return found;
+}
+
+/**
+* Pulls what the lookups of a batch are going to touch into the cache, in
+* stages so that the misses of all keys overlap: first the control group
+* each hash probes first, then the slot of the first fingerprint match in
+* it and finally the block that slot refers to.
+*/
+void IPC_KV::prefetch(const std::vector<uint64_t>& hashCodes)
+{
+	auto capacity = m_controller->getDataCapacity();
+
+	std::vector<size_t> buckets(hashCodes.size(), SIZE_MAX);
+
+	for (auto hashCode : hashCodes)
+		m_controller->prefetchGroup(get_probe_position(hashCode, 0, capacity));
+
+	for (size_t i = 0; i < hashCodes.size(); i++)
+	{
+		auto position = get_probe_position(hashCodes[i], 0, capacity);
+		auto match = m_controller->matchControl(position, IPC_KV_Controller::getControlFingerprint(hashCodes[i]));
+
+		if (match)
+		{
+			buckets[i] = (position + ipc_count_trailing_zeros(match)) & (capacity - 1);
+
+			ipc_prefetch(&m_controller->m_data[buckets[i]]);
+		}
+	}
+
+	for (auto bucket : buckets)
+	{
+		size_t available;
+
+		if (bucket != SIZE_MAX)
+			ipc_prefetch(m_controller->findBlock(m_controller->getDataBlock(bucket), available));
+	}
+}
+
+bool IPC_KV::find(IPC_KV_Controller* controller, const std::string& key, uint64_t hashCode, unsigned char* data, size_t& size, uint64_t& version)
+{
+	size_t capacity = controller->getDataCapacity();
+	uint8_t fingerprint = IPC_KV_Controller::getControlFingerprint(hashCode);
+
+	for (size_t probeIndex = 0; probeIndex < capacity / IPCKV_GROUP_WIDTH; probeIndex++)
+	{
+		size_t position = get_probe_position(hashCode, probeIndex, capacity);
+
+		for (auto match = controller->matchControl(position, fingerprint); match; match &= match - 1)
+		{
+			size_t bucket = (position + ipc_count_trailing_zeros(match)) & (capacity - 1);
+
+			IPC_KV_Data_State state;
+			bool is_match;
+			uint64_t expiry;
+
+			while (!controller->readData(bucket, key, hashCode, state, is_match, data, size, expiry, version));
+
+			if (is_match)
+			{
+				record_probes(probeIndex + 1);
+
+				// Left for a write to reclaim, this path takes no lock.
+				if (expiry && expiry <= get_time_ms())
+					return false;
+
+				if (m_is_cache)
+					controller->touchData(bucket);
+
+				return true;
+			}
+		}
+
+		if (controller->matchControl(position, IPCKV_CONTROL_EMPTY))
+		{
+			record_probes(probeIndex + 1);
+
+			return false;
+		}
+	}
+
+	return false;
+}
+
+size_t IPC_KV::find_bucket(IPC_KV_Controller* controller, const std::string& key, uint64_t hashCode)
+{
+	size_t capacity = controller->getDataCapacity();
+	uint8_t fingerprint = IPC_KV_Controller::getControlFingerprint(hashCode);
+
+	for (size_t probeIndex = 0; probeIndex < capacity / IPCKV_GROUP_WIDTH; probeIndex++)
+	{
+		size_t position = get_probe_position(hashCode, probeIndex, capacity);
+
+		for (auto match = controller->matchControl(position, fingerprint); match; match &= match - 1)
+		{
+			size_t bucket = (position + ipc_count_trailing_zeros(match)) & (capacity - 1);
+
+			if (controller->getDataHash(bucket) == hashCode && controller->getDataKey(bucket) == key)
+			{
+				record_probes(probeIndex + 1);
+
+				return bucket;
+			}
+		}
+
+		if (controller->matchControl(position, IPCKV_CONTROL_EMPTY))
+		{
+			record_probes(probeIndex + 1);
+
+			return SIZE_MAX;
+		}
+	}
+
+	return SIZE_MAX;
+}
+
+/**
+* Finds key in whichever generation holds it and sets controller to that
+* one, deleting it instead if it expired. Must be called with the write
+* lock held.
+*/
+size_t IPC_KV::find_live_bucket(const std::string& key, uint64_t hashCode, IPC_KV_Controller*& controller)
+{
+	for (auto candidate : { m_controller, m_old_controller })
+	{
+		if (!candidate)
+			continue;
+
+		size_t bucket = find_bucket(candidate, key, hashCode);
+
+		if (bucket == SIZE_MAX)
+			continue;
+
+		if (is_expired(candidate, bucket))
+		{
+			expire(candidate, bucket);
+
+			return SIZE_MAX;
+		}
+
+		controller = candidate;
+
+		return bucket;
+	}
+
+	return SIZE_MAX;
+}
+
+size_t IPC_KV::find_free_bucket(IPC_KV_Controller* controller, uint64_t hashCode)
+{
+	size_t capacity = controller->getDataCapacity();
+
+	for (size_t probeIndex = 0; probeIndex < capacity / IPCKV_GROUP_WIDTH; probeIndex++)
+	{
+		size_t position = get_probe_position(hashCode, probeIndex, capacity);
+
+		auto free = controller->matchControl(position, IPCKV_CONTROL_EMPTY) 
+			| controller->matchControl(position, IPCKV_CONTROL_DELETED);
+
+		if (free)
+		{
+			return (position + ipc_count_trailing_zeros(free)) & (capacity - 1);
+		}
+	}
+
+	return SIZE_MAX;
+}
+
+void IPC_KV::set(const std::string& key, unsigned char* data, size_t size)
+{
+	set_until(key, data, size, 0);
+}
+
+void IPC_KV::set(const std::string& key, unsigned char* data, size_t size, std::chrono::milliseconds ttl)
+{
+	if (ttl.count() <= 0)
+		throw std::runtime_error("ttl must be positive.");
+
+	set_until(key, data, size, get_time_ms() + uint64_t(ttl.count()));
+}
+
+void IPC_KV::set_until(const std::string& key, unsigned char* data, size_t size, uint64_t expiry)
+{
+	auto lock = get_lock(IPCKV_WRITE_LOCK);
+
+	store(key, hash(key.c_str(), key.length()), data, size, expiry);
+}
+
+/**
+* Sets key and returns the version of the value. Must be called with the
+* write lock held.
+*/
+uint64_t IPC_KV::store(const std::string& key, uint64_t hashCode, unsigned char* data, size_t size, uint64_t expiry)
+{
+	if (size > IPCKV_DATA_SIZE)
+		throw std::runtime_error("data size is too big");
+
+	if (key.length() >= IPCKV_KEY_SIZE - 1)
+		throw std::runtime_error("key size is too big");
+
+	if (m_is_cache)
+		make_room(key, hashCode, sizeof(IPC_KV_Block) + key.length() + size);
+
+	if (is_overloaded(0))
+	{
+		resize();
+	}
+	else
+	{
+		migrate(get_migrate_count(0));
+		sweep_buckets(IPCKV_SWEEP_BUCKETS);
+	}
+
+	IPC_KV_Stats_Slot::add(m_stats->m_sets);
+
+	if (insert(key, hashCode, data, size, expiry))
+	{
+		m_controller->startInfoTransaction(); 
+		m_controller->setSize(m_controller->getSize() + 1);
+		m_controller->commitInfo();
+	}
+
+	return m_controller->getNextVersion() - 1;
+}
+
+uint64_t IPC_KV::compare_and_set(const std::string& key, uint64_t expected_version, unsigned char* data, size_t size, std::chrono::milliseconds ttl)
+{
+	auto expiry = get_expiry(ttl);
+	auto hashCode = hash(key.c_str(), key.length());
+
+	auto lock = get_lock(IPCKV_WRITE_LOCK);
+
+	IPC_KV_Controller* controller;
+	auto bucket = find_live_bucket(key, hashCode, controller);
+
+	auto version = bucket == SIZE_MAX ? 0 : controller->getDataVersion(bucket);
+
+	if (version != expected_version)
+		return 0;
+
+	return store(key, hashCode, data, size, expiry);
+}
+
+uint64_t IPC_KV::set_if_absent(const std::string& key, unsigned char* data, size_t size, std::chrono::milliseconds ttl)
+{
+	return compare_and_set(key, 0, data, size, ttl);
+}
+
+int64_t IPC_KV::fetch_add(const std::string& key, int64_t delta)
+{
+	auto hashCode = hash(key.c_str(), key.length());
+
+	auto lock = get_lock(IPCKV_WRITE_LOCK);
+
+	IPC_KV_Controller* controller;
+	auto bucket = find_live_bucket(key, hashCode, controller);
+
+	int64_t value = 0;
+	uint64_t expiry = 0;
+
+	if (bucket != SIZE_MAX)
+	{
+		if (controller->getDataSize(bucket) != sizeof(value))
+			throw std::runtime_error("value is not a 64-bit integer.");
+
+		std::memcpy(&value, controller->getData(bucket), sizeof(value));
+		expiry = controller->getDataExpiry(bucket);
+	}
+
+	// Wraps around rather than overflowing.
+	auto result = int64_t(uint64_t(value) + uint64_t(delta));
+
+	store(key, hashCode, (unsigned char*)&result, sizeof(result), expiry);
+
+	return value;
+}
+
+/**
+* When a key given ttl expires, zero for never.
+*/
+uint64_t IPC_KV::get_expiry(std::chrono::milliseconds ttl)
+{
+	if (ttl.count() < 0)
+		throw std::runtime_error("ttl must not be negative.");
+
+	return ttl.count() ? get_time_ms() + uint64_t(ttl.count()) : 0;
+}
+
+void IPC_KV::multi_set(const std::vector<std::string>& keys, const std::vector<std::string_view>& values)
+{
+	if (keys.size() != values.size())
+		throw std::runtime_error("keys and values do not match");
+
+	std::vector<uint64_t> hashCodes;
+	hashCodes.reserve(keys.size());
+
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		if (values[i].size() > IPCKV_DATA_SIZE)
+			throw std::runtime_error("data size is too big");
+
+		if (keys[i].length() >= IPCKV_KEY_SIZE - 1)
+			throw std::runtime_error("key size is too big");
+
+		hashCodes.push_back(hash(keys[i].c_str(), keys[i].length()));
+	}
+
+	//////////////////////////////////////////
+
+	auto lock = get_lock(IPCKV_WRITE_LOCK);
+
+	prefetch(hashCodes);
+
+	size_t added = 0;
+
+	// Migrating and sweeping commit the size of keys they find expired,
+	// so the keys added are committed on top of whatever it is by then.
+	auto commit_size = [&]() {
+		if (!added)
+			return;
+
+		m_controller->startInfoTransaction(); 
+		m_controller->setSize(m_controller->getSize() + added);
+		m_controller->commitInfo();
+
+		added = 0;
+	};
+
+	try
+	{
+		for (size_t i = 0; i < keys.size(); i++)
+		{
+			// Evicting commits the size, so a cache keeps it committed.
+			if (m_is_cache)
+			{
+				commit_size();
+
+				make_room(keys[i], hashCodes[i], sizeof(IPC_KV_Block) + keys[i].length() + values[i].size());
+			}
+
+			if (is_overloaded(added))
+			{
+				// The resize decides by the size whether to grow.
+				commit_size();
+
+				resize();
+			}
+			else
+			{
+				migrate(get_migrate_count(added));
+				sweep_buckets(IPCKV_SWEEP_BUCKETS);
+			}
+
+			IPC_KV_Stats_Slot::add(m_stats->m_sets);
+
+			if (insert(keys[i], hashCodes[i], (unsigned char*)values[i].data(), values[i].size(), 0))
+				added++;
+		}
+	}
+	catch (...)
+	{
+		// Whatever made it in before the failure stays in.
+		commit_size();
+
+		throw;
+	}
+
+	commit_size();
+}
+
+/**
+* Stores key in the current generation, leaving the size to the caller.
+* Returns true if the key was not in the store before.
+*/
+bool IPC_KV::insert(const std::string& key, uint64_t hashCode, unsigned char* data, size_t size, uint64_t expiry)
+{
+	size_t bucket = find_bucket(m_controller, key, hashCode);
+	size_t old_bucket = bucket == SIZE_MAX && m_old_controller ? find_bucket(m_old_controller, key, hashCode) : SIZE_MAX;
+
+	// Allocate before touching anything so that a full
+	// heap leaves the table as it was.
+	auto block = m_controller->createBlock(key.c_str(), key.length(), data, size, m_controller->getNextVersion());
+	uint64_t node = 0;
+
+	if (m_is_ordered && bucket == SIZE_MAX && old_bucket == SIZE_MAX)
+	{
+		try
+		{
+			node = m_controller->createIndexNode(key, hashCode);
+		}
+		catch (...)
+		{
+			m_controller->freeBlock(block);
+
+			throw;
+		}
+	}
+
+	if (expiry)
+		m_controller->m_info->m_has_expiry = true;
+
+	if (bucket != SIZE_MAX)
+	{
+		m_controller->startDataTransaction(bucket);
+		m_controller->setDataBlock(bucket, block);
+		m_controller->setDataExpiry(bucket, expiry);
+		m_controller->commitData(bucket);
+		m_controller->publishEvent(EventSet, hashCode);
+
+		return false;
+	}
+
+	bucket = find_free_bucket(m_controller, hashCode);
+
+	if (bucket == SIZE_MAX)
+	{
+		m_controller->freeBlock(block);
+
+		if (node)
+			m_controller->freeBlock(node);
+
+		throw std::runtime_error("unable to insert item due to unexpected error");
+	}
+
+	if (m_controller->getDataState(bucket) == IPC_KV_Data_State::Deleted)
+		m_controller->m_info->m_tombstones--;
+
+	m_controller->startDataTransaction(bucket);
+	m_controller->setDataBlock(bucket, block);
+	m_controller->setDataHash(bucket, hashCode);
+	m_controller->setDataExpiry(bucket, expiry);
+	m_controller->setDataState(bucket, IPC_KV_Data_State::Occupied);
+	m_controller->commitData(bucket);
+	m_controller->setControl(bucket, IPC_KV_Controller::getControlFingerprint(hashCode));
+
+	// New keys have to be read before the CLOCK comes around to be
+	// kept, so that a run of keys read once does not flush the cache.
+	m_controller->m_reference[bucket].store(0, std::memory_order_relaxed);
+
+	if (node)
+		m_controller->insertIndexNode(node);
+
+	m_controller->publishEvent(EventSet, hashCode);
+
+	// The key has not been migrated yet, it is only taken
+	// out of the old generation once the new one has it.
+	if (old_bucket != SIZE_MAX)
+	{
+		m_old_controller->startDataTransaction(old_bucket);
+		m_old_controller->setDataState(old_bucket, IPC_KV_Data_State::Deleted);
+		m_old_controller->setDataBlock(old_bucket, 0);
+		m_old_controller->commitData(old_bucket);
+		m_old_controller->setControl(old_bucket, IPCKV_CONTROL_DELETED);
+	}
+
+	return old_bucket == SIZE_MAX;
+}
+
+size_t IPC_KV::get_probe_position(uint64_t hashCode, size_t probeIndex, size_t capacity)
+{
+	// Triangular numbers modulo a power of two visit every residue, so
+	// the capacity being one lets a mask stand in for the modulo.
+	size_t step = m_probing == IPC_KV_Probing::Linear ? probeIndex : probeIndex * (probeIndex + 1) / 2;
+
+	return size_t(hashCode + IPCKV_GROUP_WIDTH * step) & (capacity - 1);
+}
+
+void IPC_KV::print()
+{
+#ifdef _DEBUG
+	auto lock = get_lock(IPCKV_READ_LOCK);
+
+	////////////////////////////////////////////////////
+
+	for (auto controller : { m_old_controller, m_controller })
+	{
+		if (!controller)
+			continue;
+
+		auto capacity = controller->getDataCapacity();
+
+		for (size_t i = 0; i < capacity; i++)
+		{
+			if (controller->getDataState(i) == IPC_KV_Data_State::Occupied)
+			{
+				auto key = controller->getDataKey(i);
+
+				LOG("[%zd] %.*s 0x%zX\n", i, int(key.size()), key.data(), controller->getDataSize(i));
+			}
+
+			if (controller->getDataState(i) == IPC_KV_Data_State::Deleted)
+				LOG("[%zd] Deleted\n", i);
+		}
+	}
+
+	LOG("Capacity %zd, Size %zd, Resizes %zd, Load Factor %f, Migrating %zd\n",
+		m_controller->getCapacity(), 
+		m_controller->getSize(),
+		m_controller->getResizeCount(), 
+		IPCKV_LOAD_FACTOR,
+		m_controller->getOldCapacity()
+	);
+
+#endif
+}
+ 
+
+/**
+* Takes the lock and catches up with resizes. A writer that died holding
+* the lock may have left the store halfway through a change, so whoever
+* takes the lock next takes it for writing and recovers the store first,
+* unless it is an observer, which waits for somebody else to.
+*/
+IPC_Lock IPC_KV::get_lock(bool is_writing)
+{
+	auto start = std::chrono::steady_clock::now();
+	auto& rw_lock = m_controller->m_info->m_lock;
+
+	while (true)
+	{
+		if (m_is_observer)
+			wait_for_recovery();
+
+		bool should_recover = rw_lock.m_is_abandoned.load() && !m_is_observer;
+
+		IPC_Lock lock(is_writing || should_recover, &rw_lock, m_controller->m_lock_semaphore);
+
+		if (m_resize_count != m_controller->getResizeCount())
+		{ 
+			LOG("Expired memory, fetching new memory.\n");
+
+			map_generations();
+		}
+		else if (m_old_controller && !m_controller->getOldCapacity())
+		{
+			LOG("Migration finished, releasing old memory.\n");
+
+			delete m_old_controller;
+
+			m_old_controller = nullptr;
+		}
+
+		if (rw_lock.m_is_abandoned.load())
+		{
+			// Noticed only once we had the lock for reading, or by an observer.
+			if ((!is_writing && !should_recover) || m_is_observer)
+				continue;
+
+			rw_lock.m_is_abandoned = 0;
+
+			recover();
+		}
+
+		// Recovered, now take the lock we were asked for.
+		if (should_recover && !is_writing)
+			continue;
+
+		IPC_KV_Stats_Slot::add(m_stats->m_locks);
+		IPC_KV_Stats_Slot::add(m_stats->m_lock_wait_ns, uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()));
+
+		return lock;
+	}
+}
+
+/**
+* Gives the store's own instances IPCKV_LOCK_STALE_MS to recover it after
+* a writer died, see get_lock. A store nobody else is using stays as it is
+* until it is attached to again.
+*/
+void IPC_KV::wait_for_recovery()
+{
+	auto& rw_lock = m_controller->m_info->m_lock;
+
+	for (int waited = 0; rw_lock.m_is_abandoned.load(); waited += IPCKV_LOCK_CHECK_MS)
+	{
+		if (waited >= IPCKV_LOCK_STALE_MS)
+			throw std::runtime_error("store was abandoned by a writer.");
+
+		ipc_sleep(IPCKV_LOCK_CHECK_MS);
+	}
+}
+
+void IPC_KV::map_generations()
+{
+	if (m_controller->m_control)
+	{
+		ipc_unmap_shared_memory(m_controller->m_control, m_controller->m_data_size);
+		ipc_close_handle(m_controller->m_data_handle);
+	}
+
+	auto resize_count = m_controller->getResizeCount();
+
+	auto data_tuple = initialize_data(
+		m_name,
+		m_controller->getCapacity(),
+		resize_count
+	);
+
+	m_controller->setDataMapping(
+		std::get<0>(data_tuple),
+		std::get<1>(data_tuple),
+		m_controller->getCapacity()
+	);
+
+	//////////////////////////////////////////
+
+	delete m_old_controller;
+
+	m_old_controller = nullptr;
+
+	if (m_controller->getOldCapacity())
+	{
+		auto old_data_tuple = initialize_data(
+			m_name,
+			m_controller->getOldCapacity(),
+			resize_count - 1
+		);
+
+		m_old_controller = new IPC_KV_Controller();
+		m_old_controller->m_heap_owner = m_controller;
+		m_old_controller->setDataMapping(
+			std::get<0>(old_data_tuple),
+			std::get<1>(old_data_tuple),
+			m_controller->getOldCapacity()
+		);
+	}
+
+	m_resize_count = resize_count;
+}
+
+/**
+* Tombstones count towards the load since probes have to walk past them too.
+*/
+bool IPC_KV::is_overloaded(size_t pending)
+{
+	auto used = m_controller->getSize() + pending + m_controller->m_info->m_tombstones;
+
+	return (float)used / (float)m_controller->getCapacity() >= IPCKV_MAX_LOAD_FACTOR;
+}
+
+void IPC_KV::resize()
+{  
+	LOG("Resizing memory.\n");
+
+	auto start = std::chrono::steady_clock::now();
+
+	// Only two generations can be around at a time. Migration is paced to
+	// be done by the time the table fills up, so at most what one write
+	// would have moved is left.
+	if (m_old_controller)
+		migrate(get_migrate_count(0));
+
+	//////////////////////////////////////////
+
+	auto old_capacity = m_controller->getCapacity();
+	auto new_capacity = old_capacity;
+
+	// When it is mostly tombstones that fill the table rebuilding it at
+	// the same size is enough, which goes through migration all the same.
+	// Caches are sized for their limit and only ever rebuilt.
+	if (!m_controller->m_info->m_max_entries && m_controller->getSize() >= old_capacity * IPCKV_MAX_LOAD_FACTOR / 2)
+		new_capacity = old_capacity * 2;
+
+	auto new_resize_count = m_controller->getResizeCount() + 1;
+
+	auto new_data_tuple = initialize_data(m_name, new_capacity, new_resize_count);
+
+	m_controller->startInfoTransaction();
+	m_controller->setCapacity(new_capacity);
+	m_controller->setResizeCount(new_resize_count);
+	m_controller->setOldCapacity(old_capacity);
+	m_controller->commitInfo();
+
+	m_controller->m_info->m_migrate_index = 0;
+	m_controller->m_info->m_sweep_index = 0;
+	m_controller->m_info->m_clock_hand = 0;
+	m_controller->m_info->m_tombstones = 0;
+
+	//////////////////////////////////////////
+
+	m_old_controller = new IPC_KV_Controller();
+	m_old_controller->m_heap_owner = m_controller;
+
+	std::swap(m_controller->m_data, m_old_controller->m_data);
+	std::swap(m_controller->m_control, m_old_controller->m_control);
+	std::swap(m_controller->m_reference, m_old_controller->m_reference);
+	std::swap(m_controller->m_data_handle, m_old_controller->m_data_handle);
+	std::swap(m_controller->m_data_size, m_old_controller->m_data_size);
+	std::swap(m_controller->m_data_capacity, m_old_controller->m_data_capacity);
+
+	m_controller->setDataMapping(std::get<0>(new_data_tuple), std::get<1>(new_data_tuple), new_capacity);
+
+	m_resize_count = new_resize_count;
+
+	IPC_KV_Stats_Slot::add(m_stats->m_resizes);
+	IPC_KV_Stats_Slot::add(m_stats->m_resize_ns, uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()));
+}
+
+/**
+* How many slots of the old generation every write moves, enough for the
+* last of them to have moved by the write that fills the table up to
+* IPCKV_MAX_LOAD_FACTOR, which starts the next resize. A write takes up at
+* most one more slot, so the share of each write never grows as the table
+* fills, and a resize never finishes more than one write's share.
+*/
+size_t IPC_KV::get_migrate_count(size_t pending)
+{
+	if (!m_old_controller)
+		return 0;
+
+	auto remaining = m_old_controller->getDataCapacity() - m_controller->m_info->m_migrate_index;
+	auto used = m_controller->getSize() + pending + m_controller->m_info->m_tombstones;
+	auto limit = size_t((float)m_controller->getCapacity() * IPCKV_MAX_LOAD_FACTOR);
+	auto writes_left = limit > used ? limit - used : 1;
+
+	return std::max<size_t>(IPCKV_MIGRATE_BUCKETS, (remaining + writes_left - 1) / writes_left);
+}
+
+/**
+* Moves up to count slots of the old generation into the current one. Attached
+* instances keep reading both generations until the last slot has moved, at
+* which point the old generation is unlinked.
+*/
+void IPC_KV::migrate(size_t count)
+{
+	if (!m_old_controller)
+		return;
+
+	auto& migrate_index = m_controller->m_info->m_migrate_index;
+	auto old_capacity = m_old_controller->getDataCapacity();
+
+	for (size_t i = 0; i < count && migrate_index < old_capacity; i++, migrate_index++)
+	{
+		if (m_old_controller->getDataState(migrate_index) != IPC_KV_Data_State::Occupied)
+			continue;
+
+		if (is_expired(m_old_controller, migrate_index))
+		{
+			expire(m_old_controller, migrate_index);
+
+			continue;
+		}
+
+		// The stored hash spares reading the key back from the heap.
+		uint64_t hashCode = m_old_controller->getDataHash(migrate_index);
+		size_t bucket = find_free_bucket(m_controller, hashCode);
+
+		if (bucket == SIZE_MAX)
+			throw std::runtime_error("unable to resize item due to unexpected error");
+
+		if (m_controller->getDataState(bucket) == IPC_KV_Data_State::Deleted)
+			m_controller->m_info->m_tombstones--;
+
+		// The block moves over as is, the heap is shared by all generations.
+		m_controller->startDataTransaction(bucket);
+		m_controller->setDataBlock(bucket, m_old_controller->getDataBlock(migrate_index));
+		m_controller->setDataHash(bucket, hashCode);
+		m_controller->setDataExpiry(bucket, m_old_controller->getDataExpiry(migrate_index));
+		m_controller->setDataState(bucket, IPC_KV_Data_State::Occupied);
+		m_controller->commitData(bucket);
+		m_controller->setControl(bucket, IPC_KV_Controller::getControlFingerprint(hashCode));
+		m_controller->m_reference[bucket].store(m_old_controller->m_reference[migrate_index].load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+		// Keeping the block reference stops the commit from freeing it.
+		m_old_controller->startDataTransaction(migrate_index);
+		m_old_controller->setDataState(migrate_index, IPC_KV_Data_State::Deleted);
+		m_old_controller->commitData(migrate_index);
+		m_old_controller->setControl(migrate_index, IPCKV_CONTROL_DELETED);
+	}
+
+	if (migrate_index < old_capacity)
+		return;
+
+	//////////////////////////////////////////
+
+	LOG("Migration finished.\n");
+
+	m_controller->startInfoTransaction();
+	m_controller->setOldCapacity(0);
+	m_controller->commitInfo();
+
+	// Attached instances let go of the old generation on their
+	// next lock, which keeps it alive until then.
+	m_controller->unlinkSegment(get_data_name(m_name, m_resize_count - 1));
+
+	delete m_old_controller;
+
+	m_old_controller = nullptr;
+}
+
+size_t IPC_KV::size()
+{
+	return m_controller->getSize();
+}
+
+IPC_KV_Stats IPC_KV::stats()
+{
+	IPC_KV_Stats stats;
+
+	auto info = m_controller->m_info;
+
+	for (size_t i = 0; i < IPCKV_STATS_SLOTS; i++)
+	{
+		auto& slot = info->m_stats[i];
+
+		if (i && slot.m_process_id.load(std::memory_order_relaxed))
+			stats.m_instances++;
+
+		stats.m_gets += slot.m_gets.load(std::memory_order_relaxed);
+		stats.m_hits += slot.m_hits.load(std::memory_order_relaxed);
+		stats.m_misses += slot.m_misses.load(std::memory_order_relaxed);
+		stats.m_sets += slot.m_sets.load(std::memory_order_relaxed);
+		stats.m_removes += slot.m_removes.load(std::memory_order_relaxed);
+		stats.m_expirations += slot.m_expirations.load(std::memory_order_relaxed);
+		stats.m_evictions += slot.m_evictions.load(std::memory_order_relaxed);
+
+		for (size_t j = 0; j < IPCKV_STATS_PROBE_BUCKETS; j++)
+			stats.m_probes[j] += slot.m_probes[j].load(std::memory_order_relaxed);
+
+		stats.m_locks += slot.m_locks.load(std::memory_order_relaxed);
+		stats.m_lock_wait_ns += slot.m_lock_wait_ns.load(std::memory_order_relaxed);
+		stats.m_resizes += slot.m_resizes.load(std::memory_order_relaxed);
+		stats.m_resize_ns += slot.m_resize_ns.load(std::memory_order_relaxed);
+	}
+
+	stats.m_size = m_controller->getSize();
+	stats.m_capacity = m_controller->getCapacity();
+	stats.m_resize_count = m_controller->getResizeCount();
+	stats.m_tombstones = info->m_tombstones.load(std::memory_order_relaxed);
+	stats.m_live_bytes = size_t(info->m_heap.m_live_bytes.load(std::memory_order_relaxed));
+
+	return stats;
+}
+
+/**
+* Histogram bucket of value, 1 goes in the first, 2-3 in the second and so
+* on, with everything past the last bucket in it.
+*/
+static size_t get_log2_bucket(size_t value, size_t buckets)
+{
+	size_t bucket = 0;
+
+	while (value >>= 1)
+		bucket++;
+
+	return std::min(bucket, buckets - 1);
+}
+
+void IPC_KV::record_probes(size_t probes)
+{
+	IPC_KV_Stats_Slot::add(m_stats->m_probes[get_log2_bucket(probes, IPCKV_STATS_PROBE_BUCKETS)]);
+}
+
+IPC_KV_Inspection IPC_KV::inspect(size_t key_samples)
+{
+	while (true)
+	{
+		// Only held while remapping, the walk itself does not block writers.
+		if (
+			m_resize_count != m_controller->getResizeCount()
+			|| (m_old_controller && !m_controller->getOldCapacity())
+			)
+		{
+			auto lock = get_lock(IPCKV_READ_LOCK);
+		}
+
+		auto resize_count = m_resize_count;
+		auto info = m_controller->m_info;
+
+		IPC_KV_Inspection inspection;
+
+		inspection.m_resize_count = resize_count;
+		inspection.m_capacity = m_controller->getDataCapacity();
+		inspection.m_old_capacity = m_old_controller ? m_old_controller->getDataCapacity() : 0;
+		inspection.m_size = m_controller->getSize();
+		inspection.m_load_factor = float(inspection.m_size) / float(inspection.m_capacity);
+
+		auto key_step = key_samples && inspection.m_size > key_samples ? inspection.m_size / key_samples : 1;
+
+		for (auto controller : { m_old_controller, m_controller })
+		{
+			if (!controller)
+				continue;
+
+			inspect_generation(controller, inspection, key_step, key_samples);
+
+			inspection.m_table_bytes += controller->m_data_size;
+		}
+
+		inspection.m_info_bytes = sizeof(IPC_KV_Info);
+		inspection.m_live_bytes = size_t(info->m_heap.m_live_bytes.load(std::memory_order_relaxed));
+
+		auto chunk_count = std::min<uint64_t>(info->m_heap.m_chunk_count.load(), IPCKV_HEAP_MAX_CHUNKS);
+
+		for (size_t i = 0; i < chunk_count; i++)
+			inspection.m_heap_bytes += size_t(info->m_heap.m_chunk_size[i]);
+
+		// The walk may have seen a generation that was
+		// abandoned halfway through, so do it again.
+		if (resize_count != m_controller->getResizeCount())
+			continue;
+
+		return inspection;
+	}
+}
+
+/**
+* Goes over the control bytes of a generation, reading the slots of full
+* ones for their hash and, every key_step of them, their key.
+*/
+void IPC_KV::inspect_generation(IPC_KV_Controller* controller, IPC_KV_Inspection& inspection, size_t key_step, size_t key_samples)
+{
+	auto capacity = controller->getDataCapacity();
+	size_t cluster = 0;
+	size_t full = 0;
+
+	auto add_cluster = [&]() {
+		if (!cluster)
+			return;
+
+		inspection.m_clusters[get_log2_bucket(cluster, IPCKV_INSPECT_CLUSTER_BUCKETS)]++;
+		inspection.m_max_cluster = std::max(inspection.m_max_cluster, cluster);
+
+		cluster = 0;
+	};
+
+	for (size_t i = 0; i < capacity; i++)
+	{
+		auto control = controller->m_control[i];
+
+		if (control == IPCKV_CONTROL_EMPTY)
+		{
+			add_cluster();
+
+			continue;
+		}
+
+		cluster++;
+
+		if (control == IPCKV_CONTROL_DELETED)
+		{
+			inspection.m_tombstones++;
+
+			continue;
+		}
 
-	//////////////////////////////////////
+		inspection.m_occupied++;
 
-	initialize_info(m_name);
+		bool is_sampled = key_samples && full++ % key_step == 0 && inspection.m_keys.size() < key_samples;
 
-	//////////////////////////////////////
+		IPC_KV_Data_State state;
+		uint64_t hashCode;
+		std::string key;
 
-	auto data_tuple = initialize_data(
-		m_name, 
-		m_controller->getCapacity(), 
-		m_controller->getResizeCount()
-	); 
+		while (!controller->readDataKey(i, state, hashCode, is_sampled ? &key : nullptr));
 
-	m_controller->m_data = std::get<0>(data_tuple);
-	m_controller->m_data_handle = std::get<1>(data_tuple);
-} 
+		if (state != IPC_KV_Data_State::Occupied)
+			continue;
 
-IPC_KV::~IPC_KV()
+		if (is_sampled)
+			inspection.m_keys.push_back(key);
+
+		// The first probe whose group covers the slot.
+		size_t distance = 0;
+
+		while (distance < capacity / IPCKV_GROUP_WIDTH && ((i - get_probe_position(hashCode, distance, capacity)) & (capacity - 1)) >= IPCKV_GROUP_WIDTH)
+			distance++;
+
+		inspection.m_probe_distances[get_log2_bucket(distance + 1, IPCKV_STATS_PROBE_BUCKETS)]++;
+		inspection.m_max_probe_distance = std::max(inspection.m_max_probe_distance, distance + 1);
+	}
+
+	add_cluster();
+}
+
+uint64_t IPC_KV::hash(const char* key, size_t count)
+{
+	return IPC_KV_Hash_Policy::hash(key, count);
+}
+
+//////////////////////////////////////////////////
+
+IPC_KV_Sharded::IPC_KV_Sharded(const std::string& name, size_t shard_count, const IPC_KV_Options& options)
+{
+	if (shard_count == 0 || shard_count > UINT32_MAX)
+		throw std::runtime_error("invalid shard count.");
+
+	m_name = name;
+	m_store_directory = options.m_directory;
+
+	initialize_directory(shard_count);
+
+	for (size_t i = 0; i < shard_count; i++)
+		m_shards.push_back(std::make_unique<IPC_KV>(m_name + "_s" + std::to_string(i), options));
+}
+
+IPC_KV_Sharded::~IPC_KV_Sharded()
 {
 	close();
 }
 
-void IPC_KV::initialize_info(const std::string& name)
+void IPC_KV_Sharded::initialize_directory(size_t shard_count)
 {
-	auto handle_path = "ipckv_i_" + name;
+	auto handle_path = "ipckv_d_" + m_name;
 
-	if (handle_path.length() > MAX_PATH)
+	if (handle_path.length() > IPCKV_MAX_PATH)
 	{
 		throw std::runtime_error("key is too long.");
 	}
-	
+
 	//////////////////////////////////////////////////
 
-	auto info_handle = CreateFileMapping(
-		INVALID_HANDLE_VALUE,
-		NULL,
-		PAGE_READWRITE,
-		0,
-		sizeof(IPC_KV_Info),
-		handle_path.c_str()
-	);
+	IPC_Handle directory_handle;
+	bool does_already_exist;
 
-	if (info_handle == NULL)
+	// Persistent stores keep it next to the shards' files.
+	auto buffer = m_store_directory.empty()
+		? ipc_map_shared_memory(handle_path, sizeof(IPC_KV_Directory), directory_handle, does_already_exist)
+		: ipc_map_file(m_store_directory + "/" + handle_path, sizeof(IPC_KV_Directory), directory_handle, does_already_exist);
+
+	if (buffer == nullptr)
 	{
-		throw std::runtime_error("could not create file mapping object.");
+		throw std::runtime_error("could not map view of file.");
 	}
 
+	auto directory = (IPC_KV_Directory*)buffer;
+
 	//////////////////////////////////////////////////
 
-	bool does_already_exist = GetLastError() == ERROR_ALREADY_EXISTS;
+	if (!does_already_exist)
+	{
+		directory->m_shard_count = uint32_t(shard_count);
+	}
 
-	auto buffer = MapViewOfFile(
-		info_handle,
-		FILE_MAP_ALL_ACCESS,
-		0,
-		0,
-		sizeof(IPC_KV_Info)
-	);
+	// The creator might not have filled it in yet.
+	for (int i = 0; directory->m_shard_count.load() == 0 && i < IPCKV_MAP_RETRIES; i++)
+		ipc_sleep(1);
 
-	if (buffer == NULL)
+	if (directory->m_shard_count.load() != shard_count)
 	{
-		CloseHandle(info_handle);
+		ipc_unmap_shared_memory(buffer, sizeof(IPC_KV_Directory));
+		ipc_close_handle(directory_handle);
 
-		throw std::runtime_error("could not map view of file.");
+		throw std::runtime_error("shard count does not match.");
 	}
 
-	//////////////////////////////////////////////////
+	m_directory = directory;
+	m_directory_handle = directory_handle;
 
-	m_controller->m_info = (IPC_KV_Info*)buffer;
-	m_controller->m_info_handle = info_handle;
+	// Files are never unlinked, so there is nothing to count.
+	if (!m_store_directory.empty())
+		return;
 
-	//////////////////////////////////////////////////
+	directory->m_attach_count++;
 
-	if (!does_already_exist)
+	// The last instance detached and unlinked the segment
+	// between us opening it and attaching, so start over.
+	if (ipc_is_unlinked(directory_handle))
 	{
-		LOG("Initializing info %s...\n", handle_path.c_str());
+		directory->m_attach_count--;
 
-		m_controller->m_info->m_buffer_state = false;
+		ipc_unmap_shared_memory(buffer, sizeof(IPC_KV_Directory));
+		ipc_close_handle(directory_handle);
 
-		m_controller->startInfoTransaction();
-		m_controller->setSize(0);
-		m_controller->setResizeCount(0);
-		m_controller->setCapacity(IPCKV_INITIAL_CAPACITY);
-		m_controller->commitInfo();
-	}
+		m_directory = nullptr;
+		m_directory_handle = IPCKV_INVALID_HANDLE;
 
-	m_resize_count = m_controller->getResizeCount();
+		return initialize_directory(shard_count);
+	}
 }
 
-std::tuple<IPC_KV_Data*, HANDLE> IPC_KV::initialize_data(const std::string& name, size_t capacity, size_t resize_count)
+void IPC_KV_Sharded::close()
 {
-	auto allocation_size = DWORD(sizeof(IPC_KV_Data) * capacity);
-
-	///////////////////////////////////////////
+	for (auto& shard : m_shards)
+		shard->close();
 
-	auto handle_path = "ipckv_" + std::to_string(resize_count) + "_" + name;
+	m_shards.clear();
 
-	if (handle_path.length() > MAX_PATH)
+	if (m_directory)
 	{
-		throw std::runtime_error("key is too long."); 
-	}
-
-	///////////////////////////////////////////
+		if (m_store_directory.empty() && --m_directory->m_attach_count == 0)
+			ipc_unlink_shared_memory("ipckv_d_" + m_name);
 
-	auto data_handle = CreateFileMapping(
-		INVALID_HANDLE_VALUE,
-		NULL,
-		PAGE_READWRITE,
-		0,
-		allocation_size,
-		handle_path.c_str()
-	);
+		ipc_unmap_shared_memory(m_directory, sizeof(IPC_KV_Directory));
+		ipc_close_handle(m_directory_handle);
 
-	if (data_handle == NULL)
-	{
-		throw std::runtime_error("could not create file mapping object.");
+		m_directory = nullptr;
+		m_directory_handle = IPCKV_INVALID_HANDLE;
 	}
+}
 
-	///////////////////////////////////////////
+IPC_KV& IPC_KV_Sharded::get_shard(const std::string& key)
+{
+	return *m_shards[get_shard_index(key)];
+}
 
-	auto does_already_exist = GetLastError() == ERROR_ALREADY_EXISTS;
+size_t IPC_KV_Sharded::get_shard_index(const std::string& key)
+{
+	if (m_shards.empty())
+		throw std::runtime_error("class is in an invalid state.");
 
-	auto buffer = MapViewOfFile(
-		data_handle,
-		FILE_MAP_ALL_ACCESS,
-		0,
-		0,
-		allocation_size
-	);
+	// Shards see every key of theirs with the same remainder, so mix the
+	// hash first rather than handing the tables a skewed set of hashes.
+	uint64_t h = m_shards[0]->hash(key.c_str(), key.length());
 
-	if (buffer == NULL)
-	{
-		CloseHandle(data_handle);
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDull;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ull;
+	h ^= h >> 33;
 
-		throw std::runtime_error("could not map view of file.");
-	} 
+	return h % m_shards.size();
+}
 
-	///////////////////////////////////////////
+std::vector<std::vector<size_t>> IPC_KV_Sharded::group_keys(const std::vector<std::string>& keys)
+{
+	std::vector<std::vector<size_t>> groups(m_shards.size());
 
-	if (!does_already_exist)
-	{
-		LOG("Initializing data %s...\n", handle_path.c_str());
+	for (size_t i = 0; i < keys.size(); i++)
+		groups[get_shard_index(keys[i])].push_back(i);
 
-		std::memset(buffer, 0, allocation_size);
-	}
+	return groups;
+}
 
-	return std::make_tuple((IPC_KV_Data*)buffer, data_handle);
+void IPC_KV_Sharded::set(const std::string& key, unsigned char* data, size_t size)
+{
+	get_shard(key).set(key, data, size);
 }
 
-void IPC_KV::close()
+void IPC_KV_Sharded::set(const std::string& key, unsigned char* data, size_t size, std::chrono::milliseconds ttl)
 {
-	if (m_controller) 
-	{
-		delete m_controller;
+	get_shard(key).set(key, data, size, ttl);
+}
 
-		m_controller = nullptr;
-	}
+size_t IPC_KV_Sharded::sweep(size_t count)
+{
+	size_t expired = 0;
+
+	for (auto& shard : m_shards)
+		expired += shard->sweep(count);
+
+	return expired;
 }
 
-void IPC_KV::clear()
+bool IPC_KV_Sharded::get(const std::string& key, unsigned char* data, size_t& size)
 {
-	auto lock = get_lock(IPCKV_WRITE_LOCK);
+	return get_shard(key).get(key, data, size);
+}
 
-	auto capacity = m_controller->getCapacity();
+bool IPC_KV_Sharded::get(const std::string& key, unsigned char* data, size_t& size, uint64_t& version)
+{
+	return get_shard(key).get(key, data, size, version);
+}
 
-	for (size_t i = 0; i < capacity; i++)
-	{
-		if (m_controller->getDataState(i) == IPC_KV_Data_State::Occupied)
-		{
-			m_controller->startDataTransaction(i);
-			m_controller->setDataState(i, IPC_KV_Data_State::Deleted);
-			m_controller->commitData(i);
+uint64_t IPC_KV_Sharded::compare_and_set(const std::string& key, uint64_t expected_version, unsigned char* data, size_t size, std::chrono::milliseconds ttl)
+{
+	return get_shard(key).compare_and_set(key, expected_version, data, size, ttl);
+}
 
-			m_controller->startInfoTransaction();
-			m_controller->setSize(m_controller->getSize() - 1);
-			m_controller->commitInfo();
-		}
-	}
+uint64_t IPC_KV_Sharded::set_if_absent(const std::string& key, unsigned char* data, size_t size, std::chrono::milliseconds ttl)
+{
+	return get_shard(key).set_if_absent(key, data, size, ttl);
 }
 
-bool IPC_KV::remove(const std::string& key)
+int64_t IPC_KV_Sharded::fetch_add(const std::string& key, int64_t delta)
 {
-	auto lock = get_lock(IPCKV_WRITE_LOCK);
+	return get_shard(key).fetch_add(key, delta);
+}
 
-	size_t probeIndex = 0;
-	size_t bucketsProbed = 0;
+IPC_KV_View IPC_KV_Sharded::get_view(const std::string& key)
+{
+	return get_shard(key).get_view(key);
+}
 
-	size_t capacity = m_controller->getCapacity();
+bool IPC_KV_Sharded::remove(const std::string& key)
+{
+	return get_shard(key).remove(key);
+}
 
-	size_t hashCode = hash(key.c_str(), key.length());
-	size_t bucket = hashCode % capacity;
+size_t IPC_KV_Sharded::multi_get(const std::vector<std::string>& keys, const std::function<void(size_t, const unsigned char*, size_t)>& callback)
+{
+	auto groups = group_keys(keys);
 
-	while (bucketsProbed < capacity)
-	{
-		if (m_controller->getDataState(bucket) == IPC_KV_Data_State::Empty)
-		{
-			return false;
-		}
+	size_t found = 0;
 
-		if (
-			m_controller->getDataState(bucket) == IPC_KV_Data_State::Occupied
-			&& m_controller->getDataKey(bucket) == key
-			)
-		{
-			m_controller->startDataTransaction(bucket);
-			m_controller->setDataState(bucket, IPC_KV_Data_State::Deleted);
-			m_controller->commitData(bucket);
+	for (size_t shard = 0; shard < groups.size(); shard++)
+	{
+		auto& indices = groups[shard];
 
-			m_controller->startInfoTransaction();
-			m_controller->setSize(m_controller->getSize() - 1);
-			m_controller->commitInfo();
+		if (indices.empty())
+			continue;
 
-			return true;
-		}
+		std::vector<std::string> shard_keys;
+		shard_keys.reserve(indices.size());
 
-		probeIndex++;
+		for (auto index : indices)
+			shard_keys.push_back(keys[index]);
 
-		bucket = (hashCode + IPCKV_C1_CONSTANT * probeIndex + IPCKV_C2_CONSTANT * probeIndex * probeIndex) % capacity;
-		bucketsProbed++;
+		found += m_shards[shard]->multi_get(shard_keys, [&](size_t i, const unsigned char* data, size_t size) {
+			callback(indices[i], data, size);
+		});
 	}
 
-	return false;
+	return found;
 }
 
-bool IPC_KV::get(const std::string& key, unsigned char* data, size_t & size)
+void IPC_KV_Sharded::multi_set(const std::vector<std::string>& keys, const std::vector<std::string_view>& values)
 {
-	auto lock = get_lock(IPCKV_READ_LOCK);
+	if (keys.size() != values.size())
+		throw std::runtime_error("keys and values do not match");
 
-	size_t probeIndex = 0;
-	size_t bucketsProbed = 0;
+	auto groups = group_keys(keys);
 
-	size_t capacity = m_controller->getCapacity();
+	for (size_t shard = 0; shard < groups.size(); shard++)
+	{
+		auto& indices = groups[shard];
 
-	size_t hashCode = hash(key.c_str(), key.length());
-	size_t bucket = hashCode % capacity;
+		if (indices.empty())
+			continue;
 
-	while (bucketsProbed < capacity)
-	{
-		if (m_controller->getDataState(bucket) == IPC_KV_Data_State::Empty)
-		{
-			return false;
-		}
+		std::vector<std::string> shard_keys;
+		std::vector<std::string_view> shard_values;
 
-		if (
-			m_controller->getDataState(bucket) == IPC_KV_Data_State::Occupied 
-			&& m_controller->getDataKey(bucket) == key
-		)
-		{
-			size = m_controller->getDataSize(bucket);
+		shard_keys.reserve(indices.size());
+		shard_values.reserve(indices.size());
 
-			return memcpy_s(data, IPCKV_DATA_SIZE, m_controller->getData(bucket), size) == 0;
+		for (auto index : indices)
+		{
+			shard_keys.push_back(keys[index]);
+			shard_values.push_back(values[index]);
 		}
 
-		probeIndex++;
-
-		bucket = (hashCode + IPCKV_C1_CONSTANT * probeIndex + IPCKV_C2_CONSTANT * probeIndex * probeIndex) % capacity;
-		bucketsProbed++;
+		m_shards[shard]->multi_set(shard_keys, shard_values);
 	}
-
-	return false;
 }
 
-void IPC_KV::set(const std::string& key, unsigned char* data, size_t size)
+size_t IPC_KV_Sharded::multi_remove(const std::vector<std::string>& keys)
 {
-	auto lock = get_lock(IPCKV_WRITE_LOCK);
-
-	if (size >= IPCKV_DATA_SIZE)
-		throw std::runtime_error("data size is too big");
-
-	if (key.length() >= IPCKV_KEY_SIZE - 1)
-		throw std::runtime_error("key size is too big");
+	auto groups = group_keys(keys);
 
-	if (IPCKV_LOAD_FACTOR >= IPCKV_MAX_LOAD_FACTOR)
-		resize();
-	 
-	size_t probeIndex = 0;
-	size_t bucketsProbed = 0;
-
-	size_t capacity = m_controller->getCapacity();
+	size_t removed = 0;
 
-	size_t hashCode = hash(key.c_str(), key.length());
-	size_t bucket = hashCode % capacity;
-
-	while (bucketsProbed < capacity)
+	for (size_t shard = 0; shard < groups.size(); shard++)
 	{
-		if (m_controller->getDataState(bucket) != IPC_KV_Data_State::Occupied || m_controller->getDataKey(bucket) == key)
-		{ 
-			if (m_controller->getDataState(bucket) != IPC_KV_Data_State::Occupied)
-			{
-				m_controller->startInfoTransaction(); 
-				m_controller->setSize(m_controller->getSize() + 1);
-				m_controller->commitInfo();
-			}
+		auto& indices = groups[shard];
 
-			m_controller->startDataTransaction(bucket);
-			m_controller->setDataKey(bucket, key.c_str(), key.length());
-			m_controller->setData(bucket, data, size);
-			m_controller->setDataState(bucket, IPC_KV_Data_State::Occupied);
-			m_controller->commitData(bucket);
-			
-			return;
-		}
+		if (indices.empty())
+			continue;
 
-		LOG("Collision! %s -> %zd\n", key.c_str(), bucket);
+		std::vector<std::string> shard_keys;
+		shard_keys.reserve(indices.size());
 
-		probeIndex++;
+		for (auto index : indices)
+			shard_keys.push_back(keys[index]);
 
-		bucket = (hashCode + IPCKV_C1_CONSTANT * probeIndex + IPCKV_C2_CONSTANT * probeIndex * probeIndex) % capacity;
-		bucketsProbed++;
+		removed += m_shards[shard]->multi_remove(shard_keys);
 	}
 
-	throw std::runtime_error("unable to insert item due to unexpected error");
+	return removed;
 }
 
-void IPC_KV::print()
+void IPC_KV_Sharded::clear()
 {
-#ifdef _DEBUG
-	auto lock = get_lock(IPCKV_READ_LOCK);
+	for (auto& shard : m_shards)
+		shard->clear();
+}
 
-	////////////////////////////////////////////////////
+void IPC_KV_Sharded::print()
+{
+	for (auto& shard : m_shards)
+		shard->print();
+}
+
+size_t IPC_KV_Sharded::size()
+{
+	size_t size = 0;
 
-	auto capacity = m_controller->getCapacity();
+	for (auto& shard : m_shards)
+		size += shard->size();
 
-	for (size_t i = 0; i < capacity; i++)
+	return size;
+}
+
+std::vector<std::pair<std::string, std::string>> IPC_KV_Sharded::scan(IPC_KV_Cursor& cursor, size_t count)
+{
+	if (cursor.m_is_done || cursor.m_shard >= m_shards.size())
 	{
-		if (m_controller->getDataState(i) == IPC_KV_Data_State::Occupied)
-			LOG("[%zd] %s 0x%zX\n", i, m_controller->getDataKey(i), m_controller->getDataSize(i));
+		cursor.m_is_done = true;
 
-		if (m_controller->getDataState(i) == IPC_KV_Data_State::Deleted)
-			LOG("[%zd] Deleted\n", i);
+		return {};
 	}
 
-	LOG("Capacity %zd, Size %zd, Resizes %zd, Load Factor %f\n",
-		m_controller->getCapacity(), 
-		m_controller->getSize(),
-		m_controller->getResizeCount(), 
-		IPCKV_LOAD_FACTOR
-	);
+	auto shard = cursor.m_shard;
+	auto entries = m_shards[shard]->scan(cursor, count);
 
-#endif
+	if (cursor.m_is_done && shard + 1 < m_shards.size())
+		cursor = IPC_KV_Cursor{ SIZE_MAX, 0, false, false, shard + 1 };
+
+	return entries;
 }
- 
 
-IPC_Lock IPC_KV::get_lock(bool is_writing)
+/**
+* Every shard has its own index and a key lives in one shard only, so the
+* sorted runs of the shards merge into the result without a sort, taking
+* the least of their heads until limit entries are in.
+*/
+std::vector<std::pair<std::string, std::string>> IPC_KV_Sharded::merge(std::vector<std::vector<std::pair<std::string, std::string>>>& runs, size_t limit)
 {
-	IPC_Lock lock(is_writing, m_name);
-	 
-	if (m_resize_count != m_controller->getResizeCount())
-	{ 
-		LOG("Expired memory, fetching new memory.\n");
+	std::vector<std::pair<std::string, std::string>> entries;
+	std::vector<size_t> positions(runs.size(), 0);
 
-		UnmapViewOfFile(m_controller->m_data);
-		CloseHandle(m_controller->m_data_handle);
+	// The run whose head comes first is on top.
+	auto is_after = [&](size_t left, size_t right) {
+		return runs[left][positions[left]].first > runs[right][positions[right]].first;
+	};
 
-		auto data_tuple = initialize_data(
-			m_name,
-			m_controller->getCapacity(),
-			m_controller->getResizeCount()
-		);
+	std::priority_queue<size_t, std::vector<size_t>, decltype(is_after)> heads(is_after);
 
-		m_controller->m_data = std::get<0>(data_tuple);
-		m_controller->m_data_handle = std::get<1>(data_tuple);
-		m_resize_count = m_controller->getResizeCount();
+	for (size_t i = 0; i < runs.size(); i++)
+	{
+		if (!runs[i].empty())
+			heads.push(i);
 	}
 
-	return lock;
-}
+	while (!heads.empty() && entries.size() < limit)
+	{
+		auto run = heads.top();
+		heads.pop();
 
-void IPC_KV::resize()
-{  
-	LOG("Resizing memory.\n");
+		entries.push_back(std::move(runs[run][positions[run]++]));
 
-	//////////////////////////////////////////
+		if (positions[run] < runs[run].size())
+			heads.push(run);
+	}
 
-	auto new_capacity = find_nearest_prime(m_controller->getCapacity() * 2);
-	auto new_resize_count = m_controller->getResizeCount() + 1;
+	return entries;
+}
 
-	m_controller->startInfoTransaction();
-	m_controller->setCapacity(new_capacity);
-	m_controller->setResizeCount(new_resize_count);
+std::vector<std::pair<std::string, std::string>> IPC_KV_Sharded::range(const std::string& begin, const std::string& end, size_t limit)
+{
+	std::vector<std::vector<std::pair<std::string, std::string>>> runs;
+	runs.reserve(m_shards.size());
 
-	//////////////////////////////////////////
+	for (auto& shard : m_shards)
+		runs.push_back(shard->range(begin, end, limit));
+
+	return merge(runs, limit);
+}
 
-	IPC_KV_Controller temp_controller{};
+std::vector<std::pair<std::string, std::string>> IPC_KV_Sharded::prefix(const std::string& prefix, size_t limit)
+{
+	std::vector<std::vector<std::pair<std::string, std::string>>> runs;
+	runs.reserve(m_shards.size());
 
-	auto new_data_tuple = initialize_data(m_name, new_capacity, new_resize_count);
-	temp_controller.m_data = std::get<0>(new_data_tuple);
-	temp_controller.m_data_handle = std::get<1>(new_data_tuple);
+	for (auto& shard : m_shards)
+		runs.push_back(shard->prefix(prefix, limit));
 
-	for (size_t i = 0; i < m_controller->getCapacity(); i++)
-	{
-		if (m_controller->getDataState(i) != IPC_KV_Data_State::Occupied)
-			continue;  
+	return merge(runs, limit);
+}
 
-		auto key = m_controller->getDataKey(i);
-		auto keyLength = strlen(key);
+size_t IPC_KV_Sharded::shard_count()
+{
+	return m_shards.size();
+}
 
-		auto data = m_controller->getData(i);
-		auto data_size = m_controller->getDataSize(i);
+/**
+* Everything is summed over the shards, including the capacity and the
+* instances, of which every attached process has one per shard.
+*/
+IPC_KV_Stats IPC_KV_Sharded::stats()
+{
+	IPC_KV_Stats stats;
 
-		/////////////////////////////////////////////////////
+	for (auto& shard : m_shards)
+		stats.add(shard->stats());
 
-		size_t probeIndex = 0;
-		size_t bucketsProbed = 0;
+	return stats;
+}
 
-		size_t hashCode = hash(key, keyLength);
-		size_t bucket = hashCode % new_capacity;
+//////////////////////////////////////////////////
 
-		while (bucketsProbed < new_capacity)
-		{
-			if (temp_controller.getDataState(bucket) != IPC_KV_Data_State::Occupied || temp_controller.getDataKey(bucket) == key)
-			{
-				temp_controller.startDataTransaction(bucket);
-				temp_controller.setDataKey(bucket, key, keyLength);
-				temp_controller.setData(bucket, data, data_size);
-				temp_controller.setDataState(bucket, IPC_KV_Data_State::Occupied);
-				temp_controller.commitData(bucket);
+IPC_KV_Sweeper::IPC_KV_Sweeper(const std::string& name, std::chrono::milliseconds interval, size_t count, const IPC_KV_Options& options)
+{
+	m_kv = std::make_unique<IPC_KV>(name, options);
+	m_interval = interval;
+	m_count = count;
 
-				break;
-			}
+	m_thread = std::thread(&IPC_KV_Sweeper::run, this);
+}
 
-			probeIndex++;
+IPC_KV_Sweeper::~IPC_KV_Sweeper()
+{
+	stop();
+}
 
-			bucket = (hashCode + IPCKV_C1_CONSTANT * probeIndex + IPCKV_C2_CONSTANT * probeIndex * probeIndex) % new_capacity;
-			bucketsProbed++;
-		}
+void IPC_KV_Sweeper::stop()
+{
+	{
+		std::lock_guard<std::mutex> guard(m_mutex);
 
-		if (bucketsProbed >= new_capacity)
-			throw std::runtime_error("unable to resize item due to unexpected error");
+		m_is_stopping = true;
 	}
-	 
-	m_controller->commitInfo();
 
-	std::swap(m_controller->m_data, temp_controller.m_data);
-	std::swap(m_controller->m_data_handle, temp_controller.m_data_handle);
+	m_condition.notify_all();
 
-	m_resize_count = new_resize_count;
+	if (m_thread.joinable())
+		m_thread.join();
 }
 
-size_t IPC_KV::size()
+void IPC_KV_Sweeper::run()
 {
-	auto lock = get_lock(IPCKV_READ_LOCK);
+	std::unique_lock<std::mutex> guard(m_mutex);
 
-	////////////////////////////////////////////////////
+	while (!m_condition.wait_for(guard, m_interval, [this]() { return m_is_stopping; }))
+	{
+		guard.unlock();
 
-	return m_controller->getSize();
-}
+		try
+		{
+			m_kv->sweep(m_count);
+		}
+		catch (std::runtime_error& ex)
+		{
+			LOG("Sweeping failed: %s\n", ex.what());
+		}
 
-size_t IPC_KV::find_nearest_prime(size_t input)
-{
-	while (!is_prime(input))
-	{
-		input++;
+		guard.lock();
 	}
+}
 
-	return input;
+//////////////////////////////////////////////////
+
+IPC_KV_Watcher::IPC_KV_Watcher(IPC_KV& kv) :
+	m_events(&kv.m_controller->m_info->m_events),
+	m_semaphore(kv.m_controller->m_event_semaphore),
+	m_next(m_events->m_head.load())
+{
 }
 
-bool IPC_KV::is_prime(size_t input)
+bool IPC_KV_Watcher::poll(std::vector<IPC_KV_Event>& events, size_t max_events)
 {
-	for (int i = 2; i <= (int)sqrt(input); i++)
+	auto head = m_events->m_head.load(std::memory_order_acquire);
+
+	if (head - m_next > IPCKV_EVENTS)
+	{
+		m_next = head;
+
+		return false;
+	}
+
+	for (size_t i = 0; i < max_events && m_next != head; i++, m_next++)
 	{
-		if (input % i == 0)
+		auto& slot = m_events->m_slots[m_next & (IPCKV_EVENTS - 1)];
+
+		auto sequence = slot.m_sequence.load(std::memory_order_acquire);
+
+		IPC_KV_Event event;
+		event.m_hash = slot.m_hash.load(std::memory_order_relaxed);
+		event.m_type = IPC_KV_Event_Type(slot.m_type.load(std::memory_order_relaxed));
+		event.m_version = m_next + 1;
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		// The writer came around the ring and took the slot meanwhile.
+		if (sequence != m_next + 1 || slot.m_sequence.load(std::memory_order_relaxed) != sequence)
 		{
+			m_next = m_events->m_head.load();
+
 			return false;
 		}
+
+		events.push_back(event);
 	}
 
 	return true;
 }
 
-uint32_t IPC_KV::hash(const char * key, size_t count)
+bool IPC_KV_Watcher::wait(std::chrono::milliseconds timeout)
 {
-	typedef uint32_t* P;
-	uint32_t h = 0x811c9dc5;
-	while (count >= 8) {
-		h = (h ^ ((((*(P)key) << 5) | ((*(P)key) >> 27)) ^ *(P)(key + 4))) * 0xad3e7;
-		count -= 8;
-		key += 8;
+	auto deadline = std::chrono::steady_clock::now() + timeout;
+
+	while (true)
+	{
+		// Read before the head, so that an event published in between
+		// changes it and keeps the futex from putting us to sleep.
+		auto signal = m_events->m_signal.load();
+
+		if (m_events->m_head.load() != m_next)
+			return true;
+
+		auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+
+		if (remaining <= 0)
+			return false;
+
+		m_events->m_waiters++;
+		ipc_futex_wait(&m_events->m_signal, signal, uint32_t(std::min<long long>(remaining, INT32_MAX)), m_semaphore);
+		m_events->m_waiters--;
 	}
-#define tmp h = (h ^ *(uint16_t*)key) * 0xad3e7; key += 2;
-	if (count & 4) { tmp tmp }
-	if (count & 2) { tmp }
-	if (count & 1) { h = (h ^ *key) * 0xad3e7; }
-#undef tmp
-	return h ^ (h >> 16);
+}
+
+uint64_t IPC_KV_Watcher::hash(const std::string& key)
+{
+	return IPC_KV_Hash_Policy::hash(key.c_str(), key.length());
 }
 
 #ifdef _DEBUG
@@ -521,9 +3057,13 @@ int main()
 	};
 
 
-	std::string title = std::to_string(GetCurrentProcessId());
+	std::string title = std::to_string(ipc_get_process_id());
 
+#ifdef _WIN32
 	SetConsoleTitleA(title.c_str());
+#else
+	printf("%s\n", title.c_str());
+#endif
 
 	unsigned char dummy_data[] = { 0x68, 0x69 };
 	
@@ -549,29 +3089,26 @@ int main()
 
 		kv.remove("ABC");
 
-		unsigned char dummy_callback_data[IPCKV_DATA_SIZE];
-		size_t dummy_callback_size;
+		unsigned char dummy_callback_data[256];
+		size_t dummy_callback_size = sizeof(dummy_callback_data);
 
 		printf("Finding EFG 0x%X\n", kv.get("EFG", dummy_callback_data, dummy_callback_size));
 		*/
 
-		while (1)
+		// Prints the store on every line read, until the input ends.
+		do
 		{
 			kv.print();
-			getchar();
-		}
-
-		
+		} while (getchar() != EOF);
 	}
 	catch (std::runtime_error & ex)
 	{
-		printf("Exception %s LastError %X\n", ex.what(), GetLastError());
+		printf("Exception %s LastError %X\n", ex.what(), ipc_get_last_error());
+
+		ipc_sleep(500000000);
 	}
-	
-	
-	Sleep(500000000);
 
 	return 0;
 }
 
-#endif
\ No newline at end of file
+#endif
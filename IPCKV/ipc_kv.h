@@ -1,78 +1,522 @@
 #pragma once
-#include <Windows.h>
+#include "ipc_platform.h"
+#include "ipc_kv_hash.h"
 #include <string>
 #include <iostream>
+#include <iterator>
+#include <cstdio>
 #include <tuple> 
-
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include <climits>
+#include <algorithm>
+#include <thread>
+#include <functional>
+#include <string_view>
+#include <vector>
+#include <optional>
+#include <memory>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define IPCKV_SSE2
+#endif
 
 #ifdef _DEBUG
 #define LOG(...) printf(__VA_ARGS__)
 #else
 #define LOG(...)
 #endif
-#define IPCKV_MAX_LOCKS 24 
+#define IPCKV_LOCK_SPIN 128
+#define IPCKV_LOCK_READER_SLOTS 128
+
+// How long lock waiters sleep at most before checking that
+// the process they are waiting for is still alive.
+#define IPCKV_LOCK_CHECK_MS 100
+#define IPCKV_LOCK_COUNT_MASK 0xFFFFFFFFull
+
+// Writers waiting in line whose process is known, and how long a turn
+// can go unclaimed by a process that is not before it is passed over.
+#define IPCKV_LOCK_TICKETS 64
+#define IPCKV_LOCK_STALE_MS 1000
  
 #define IPCKV_MAX_LOAD_FACTOR 0.6f  
-#define IPCKV_INITIAL_CAPACITY 101
-#define IPCKV_DATA_SIZE 2048 
+// Capacities are powers of two, no smaller than a group.
+#define IPCKV_INITIAL_CAPACITY 128
+#define IPCKV_DATA_SIZE (1 << 20)
 #define IPCKV_KEY_SIZE 260
 
+#define IPCKV_HEAP_MIN_SHIFT 5
+#define IPCKV_HEAP_CLASSES 17
+#define IPCKV_HEAP_CHUNK_SIZE (1ull << 20)
+#define IPCKV_HEAP_MAX_CHUNK_SIZE (1ull << 30)
+#define IPCKV_HEAP_MAX_CHUNKS 256
+#define IPCKV_HEAP_CHUNK_SHIFT 40
+
 #define IPCKV_LOAD_FACTOR (float)m_controller->getSize() / (float)m_controller->getCapacity()
 
-#define IPCKV_C1_CONSTANT 3
-#define IPCKV_C2_CONSTANT 5
- 
+// Slots of the old generation every write moves at the least.
+#define IPCKV_MIGRATE_BUCKETS 128
+
+// Share of the slots a cache fills at most, leaving tombstones the room up
+// to IPCKV_MAX_LOAD_FACTOR before the table has to be rebuilt.
+#define IPCKV_CACHE_FILL 0.4f
+
+// Slots checked for expired keys by every write, by default by sweep and
+// how often IPC_KV_Sweeper calls it.
+#define IPCKV_SWEEP_BUCKETS 32
+#define IPCKV_SWEEP_BATCH 4096
+#define IPCKV_SWEEP_INTERVAL_MS 100
+
+#define IPCKV_GROUP_WIDTH 16
+#define IPCKV_CONTROL_EMPTY 0x00
+#define IPCKV_CONTROL_DELETED 0x01
+#define IPCKV_CONTROL_FULL 0x80
+
+#define IPCKV_STATS_SLOTS 64
+#define IPCKV_STATS_PROBE_BUCKETS 8
+#define IPCKV_INSPECT_CLUSTER_BUCKETS 16
+
+// Spells IPKV, checked along with the version on attaching.
+#define IPCKV_MAGIC 0x564B5049
+#define IPCKV_FORMAT_VERSION 7
+
+// Spells IPKS. Snapshots are walked a batch of slots per read lock, and
+// with the lock held throughout once resizes cut the walk short this often.
+#define IPCKV_SNAPSHOT_MAGIC 0x534B5049
+#define IPCKV_SNAPSHOT_VERSION 2
+#define IPCKV_SNAPSHOT_BATCH 4096
+#define IPCKV_SNAPSHOT_RETRIES 3
+
+// Levels of the ordered index, each about a quarter as full as the one below.
+#define IPCKV_INDEX_LEVELS 16
+
+// Slots visited per scan call unless told otherwise.
+#define IPCKV_SCAN_COUNT 1024
+
+// Events kept in the ring of a store, a power of two.
+#define IPCKV_EVENTS 1024
+
 #define IPCKV_READ_LOCK false
 #define IPCKV_WRITE_LOCK true
 
 #define IPCKV_BIT_HIGH 0b00000001
 
 class IPC_Lock;
+class IPC_KV_View;
+class IPC_KV_Sharded;
 class IPC_KV_Controller;
+class IPC_KV_Watcher;
 struct IPC_KV_Data;
 struct IPC_KV_Info;
+struct IPC_KV_Stats_Slot;
+struct IPC_KV_Snapshot_Header;
+
+/**
+* How a probe moves on from one group of slots to the next, picked when the
+* store is created. Either way every group start is visited once within
+* capacity / IPCKV_GROUP_WIDTH probes.
+*/
+enum IPC_KV_Probing
+{
+	// One group after the other, the shortest probes at low load.
+	Linear = 1,
+
+	// A step one group longer each time, which breaks up clusters.
+	Triangular = 2,
+};
+
+/**
+* Settings a store is created with. Processes attaching to an existing
+* store go by the settings it was created with instead.
+*/
+struct IPC_KV_Options
+{
+	IPC_KV_Probing m_probing = IPC_KV_Probing::Triangular;
+
+	// Throw instead of creating the store if it does not exist.
+	bool m_must_exist = false;
+
+	// Keep the keys in order as well, for IPC_KV::range and IPC_KV::prefix,
+	// at the cost of a node per key and an O(log n) update per new key.
+	bool m_is_ordered = false;
+
+	// Makes the store a cache holding at most this many keys, in a table
+	// sized for them up front that never grows. Setting a key past that,
+	// or past m_max_bytes in blocks if that is not zero, evicts keys that
+	// were not read lately first, in the order of a CLOCK.
+	size_t m_max_entries = 0;
+	size_t m_max_bytes = 0;
+
+	// Directory to keep the store in as files, which outlive every process
+	// and are recovered after a crash. Empty for shared memory, which goes
+	// away with the last instance.
+	std::string m_directory;
+
+	// Attach to an existing store only to look at it, as ipckv_inspect
+	// does. The instance does not count as attached, so closing it never
+	// unlinks or flushes the store, and it takes no stats slot and no
+	// write lock of its own. Nor does it recover a store a writer died in,
+	// it waits for one of the store's own instances to, see IPC_KV::get_lock.
+	bool m_is_observer = false;
+};
+
+/**
+* Statistics of a store as returned by IPC_KV::stats. The counters are
+* totals over every instance that has ever attached to the store.
+*/
+struct IPC_KV_Stats
+{
+	uint64_t m_gets = 0;
+	uint64_t m_hits = 0;
+	uint64_t m_misses = 0;
+	uint64_t m_sets = 0;
+	uint64_t m_removes = 0;
+
+	// Keys deleted because their time to live ran out, or to make
+	// room in a cache.
+	uint64_t m_expirations = 0;
+	uint64_t m_evictions = 0;
+
+	// Lookups by how many groups they probed, 1, 2-3, 4-7 and so on.
+	uint64_t m_probes[IPCKV_STATS_PROBE_BUCKETS] = {};
+
+	// Locks taken and the time spent waiting for them.
+	uint64_t m_locks = 0;
+	uint64_t m_lock_wait_ns = 0;
+
+	// Resizes started and the time spent in them.
+	uint64_t m_resizes = 0;
+	uint64_t m_resize_ns = 0;
+
+	size_t m_size = 0;
+	size_t m_capacity = 0;
+	size_t m_resize_count = 0;
+	size_t m_tombstones = 0;
+	size_t m_live_bytes = 0;
+
+	// Slots claimed by instances, including those of processes that died
+	// without closing until their slots are taken over.
+	uint32_t m_instances = 0;
+
+	void add(const IPC_KV_Stats& other)
+	{
+		m_gets += other.m_gets;
+		m_hits += other.m_hits;
+		m_misses += other.m_misses;
+		m_sets += other.m_sets;
+		m_removes += other.m_removes;
+		m_expirations += other.m_expirations;
+		m_evictions += other.m_evictions;
+
+		for (size_t i = 0; i < IPCKV_STATS_PROBE_BUCKETS; i++)
+			m_probes[i] += other.m_probes[i];
+
+		m_locks += other.m_locks;
+		m_lock_wait_ns += other.m_lock_wait_ns;
+		m_resizes += other.m_resizes;
+		m_resize_ns += other.m_resize_ns;
+
+		m_size += other.m_size;
+		m_capacity += other.m_capacity;
+		m_resize_count += other.m_resize_count;
+		m_tombstones += other.m_tombstones;
+		m_live_bytes += other.m_live_bytes;
+		m_instances += other.m_instances;
+	}
+
+	double hit_ratio() const
+	{
+		return m_gets ? double(m_hits) / double(m_gets) : 0.0;
+	}
+};
+
+/**
+* The layout of a store as found by IPC_KV::inspect, covering both
+* generations while a migration is under way.
+*/
+struct IPC_KV_Inspection
+{
+	size_t m_resize_count = 0;
+	size_t m_capacity = 0;
+	size_t m_old_capacity = 0;
+	size_t m_size = 0;
+	float m_load_factor = 0.0f;
+
+	// Slots found full and deleted by their control bytes.
+	size_t m_occupied = 0;
+	size_t m_tombstones = 0;
+
+	// Full slots by how many groups a lookup probes to reach them,
+	// 1, 2-3, 4-7 and so on.
+	uint64_t m_probe_distances[IPCKV_STATS_PROBE_BUCKETS] = {};
+	size_t m_max_probe_distance = 0;
+
+	// Runs of slots that are not empty by their length, 1, 2-3 and so on.
+	uint64_t m_clusters[IPCKV_INSPECT_CLUSTER_BUCKETS] = {};
+	size_t m_max_cluster = 0;
+
+	// Bytes mapped for the info, the slots of both generations and
+	// the heap, and the bytes of the heap in live blocks.
+	size_t m_info_bytes = 0;
+	size_t m_table_bytes = 0;
+	size_t m_heap_bytes = 0;
+	size_t m_live_bytes = 0;
+
+	std::vector<std::string> m_keys;
+};
+
+/**
+* Where a scan is at. Start from a default constructed cursor and keep
+* passing it back in until is_done, it is plain data so it can be kept
+* around between calls or handed to another process.
+*
+* Every key present for the whole scan is returned at least once, even
+* across resizes, while keys set or removed meanwhile may or may not be.
+* A key can come up more than once when a resize moved it past the cursor.
+*/
+struct IPC_KV_Cursor
+{
+	// Generation the cursor walks, SIZE_MAX before the first call.
+	size_t m_resize_count = SIZE_MAX;
+	size_t m_index = 0;
+
+	// The old generation of an ongoing migration is walked first.
+	bool m_is_old = false;
+	bool m_is_done = false;
+
+	// Shard the cursor is in, for IPC_KV_Sharded.
+	size_t m_shard = 0;
+
+	bool is_done() const
+	{
+		return m_is_done;
+	}
+};
+
+/**
+* What happened to a key, as reported by IPC_KV_Watcher.
+*/
+enum IPC_KV_Event_Type
+{
+	EventSet = 1,
+	EventRemove = 2,
+
+	// The whole store was emptied, by clear or load. The hash is zero.
+	EventClear = 3,
+
+	// The key was deleted because it expired or to make room in a cache.
+	EventExpire = 4,
+	EventEvict = 5,
+};
+
+struct IPC_KV_Event
+{
+	// Hash of the key, see IPC_KV_Watcher::hash.
+	uint64_t m_hash;
+	IPC_KV_Event_Type m_type;
+
+	// Position of the event in the history of the store, one higher for
+	// every event published. For EventSet the version of the value set,
+	// see IPC_KV::get.
+	uint64_t m_version;
+};
 
 class IPC_KV 
 {
+	friend class IPC_KV_Sharded;
+	friend class IPC_KV_Watcher;
 public:
 	/**
 	* Constructors and destructors
 	*/
-	IPC_KV(const std::string& name);
+	IPC_KV(const std::string& name, const IPC_KV_Options& options = IPC_KV_Options());
 	~IPC_KV();
 
 	/**
 	* Public Methods
 	*/
 	void set(const std::string& key, unsigned char* data, size_t size);
+
+	/**
+	* Sets a key that expires after ttl. Expired keys read as missing right
+	* away but keep counting towards the size until a write comes across
+	* them, the sweep that every write does gets to them or sweep is called,
+	* see IPC_KV_Sweeper. Setting the key again without a ttl keeps it
+	* for good.
+	*/
+	void set(const std::string& key, unsigned char* data, size_t size, std::chrono::milliseconds ttl);
+
+	// size holds the capacity of data on input and the size of the value on output.
 	bool get(const std::string& key, unsigned char* data, size_t& size);
+
+	/**
+	* Also sets version to that of the value, which is higher after every
+	* write to the key, even once it was removed and set again. Versions are
+	* the positions of the events publishing the writes, see IPC_KV_Event.
+	*/
+	bool get(const std::string& key, unsigned char* data, size_t& size, uint64_t& version);
+
+	// Looks the value up in place, see IPC_KV_View.
+	IPC_KV_View get_view(const std::string& key);
+
+	/**
+	* Batched operations, each under a single lock. multi_get calls callback
+	* with the index and value of every key it finds, in place and with the
+	* read lock held, and returns how many were found.
+	*/
+	size_t multi_get(const std::vector<std::string>& keys, const std::function<void(size_t, const unsigned char*, size_t)>& callback);
+	void multi_set(const std::vector<std::string>& keys, const std::vector<std::string_view>& values);
+	size_t multi_remove(const std::vector<std::string>& keys);
 	bool remove(const std::string& key);
 	void clear();
 	void print();
 	size_t size();
 	void close();
+
+	// Reads the statistics without taking the lock.
+	IPC_KV_Stats stats();
+
+	// Walks the table without taking the lock, collecting up to
+	// key_samples keys spread over it.
+	IPC_KV_Inspection inspect(size_t key_samples = 0);
+
+	/**
+	* Snapshots, see IPC_KV_Snapshot_Header. snapshot writes every entry to
+	* path holding the read lock a batch at a time, so writers get in between
+	* and entries they change meanwhile may or may not make it in. A key
+	* changed during a migration can be written twice, the later record
+	* holding the newer value. load replaces the contents of the store with
+	* those of a snapshot, sized for them up front, under a single write
+	* lock, the later of two records for a key winning.
+	*/
+	void snapshot(const std::string& path);
+	void load(const std::string& path);
+
+	/**
+	* Visits up to count slots from the cursor on under one read lock and
+	* returns the keys and values found there, which may be none even if
+	* the scan is not done yet, see IPC_KV_Cursor.
+	*/
+	std::vector<std::pair<std::string, std::string>> scan(IPC_KV_Cursor& cursor, size_t count = IPCKV_SCAN_COUNT);
+
+	/**
+	* Ordered stores only. Return up to limit keys and values in key order,
+	* those from begin up to but not including end, or those starting with
+	* prefix, under one read lock.
+	*/
+	std::vector<std::pair<std::string, std::string>> range(const std::string& begin, const std::string& end, size_t limit = SIZE_MAX);
+	std::vector<std::pair<std::string, std::string>> prefix(const std::string& prefix, size_t limit = SIZE_MAX);
+
+	// Deletes the expired keys among the next count slots under the
+	// write lock and returns how many there were.
+	size_t sweep(size_t count = IPCKV_SWEEP_BATCH);
+
+	/**
+	* Conditional writes, each checking and writing under one write lock.
+	* compare_and_set sets key only if its version is expected_version, zero
+	* standing for the key being missing, and set_if_absent only if it is
+	* missing. Both return the version of the value set, zero if it was not.
+	* A nonzero ttl works as it does for set.
+	*/
+	uint64_t compare_and_set(const std::string& key, uint64_t expected_version, unsigned char* data, size_t size, std::chrono::milliseconds ttl = std::chrono::milliseconds(0));
+	uint64_t set_if_absent(const std::string& key, unsigned char* data, size_t size, std::chrono::milliseconds ttl = std::chrono::milliseconds(0));
+
+	/**
+	* Adds delta to the 64-bit integer in host byte order stored under key,
+	* taken to be zero if the key is missing, and returns what it was before.
+	* The key keeps its time to live.
+	*/
+	int64_t fetch_add(const std::string& key, int64_t delta);
 private:
 	/**
 	* Private Methods
 	*/
-	void initialize_info(const std::string& name);
-	std::tuple<IPC_KV_Data*, HANDLE> initialize_data(const std::string& name, size_t capacity, size_t resize_count);
-
+	void claim_stats_slot();
+	void record_probes(size_t probes);
+	void inspect_generation(IPC_KV_Controller* controller, IPC_KV_Inspection& inspection, size_t key_step, size_t key_samples);
+	bool initialize_info(const std::string& name, const IPC_KV_Options& options);
+	void recover();
+	void flush();
+	void release_file_locks();
+	bool write_snapshot(FILE* file, size_t batch_size);
+	void write_snapshot_records(IPC_KV_Controller* controller, size_t begin, size_t end, std::vector<unsigned char>& buffer, IPC_KV_Snapshot_Header& header, std::vector<uint64_t>* old_versions);
+	void switch_generation(size_t capacity);
+	std::vector<std::pair<std::string, std::string>> walk_index(const std::string& begin, const std::function<bool(std::string_view)>& is_within, size_t limit);
+	std::tuple<uint8_t*, IPC_Handle, size_t> initialize_data(const std::string& name, size_t capacity, size_t resize_count);
+	std::string get_data_name(const std::string& name, size_t resize_count);
+
+	bool find(IPC_KV_Controller* controller, const std::string& key, uint64_t hashCode, unsigned char* data, size_t& size, uint64_t& version);
+	size_t find_bucket(IPC_KV_Controller* controller, const std::string& key, uint64_t hashCode);
+	size_t find_live_bucket(const std::string& key, uint64_t hashCode, IPC_KV_Controller*& controller);
+	size_t find_free_bucket(IPC_KV_Controller* controller, uint64_t hashCode);
+
+	void set_until(const std::string& key, unsigned char* data, size_t size, uint64_t expiry);
+	uint64_t store(const std::string& key, uint64_t hashCode, unsigned char* data, size_t size, uint64_t expiry);
+	uint64_t get_expiry(std::chrono::milliseconds ttl);
+	bool insert(const std::string& key, uint64_t hashCode, unsigned char* data, size_t size, uint64_t expiry);
+	bool erase(const std::string& key, uint64_t hashCode);
+	void remove_slot(IPC_KV_Controller* controller, size_t bucket, IPC_KV_Event_Type type);
+	void expire(IPC_KV_Controller* controller, size_t bucket);
+	bool is_expired(IPC_KV_Controller* controller, size_t bucket);
+	size_t sweep_buckets(size_t count);
+	void make_room(const std::string& key, uint64_t hashCode, size_t bytes);
+	bool evict();
+	bool evict_generation(IPC_KV_Controller* controller, size_t begin);
+	void prefetch(const std::vector<uint64_t>& hashCodes);
+
+	size_t get_probe_position(uint64_t hashCode, size_t probeIndex, size_t capacity);
+
+	bool is_overloaded(size_t pending);
 	void resize();
-	bool is_prime(size_t input);
-
-	size_t find_nearest_prime(size_t input);
-	uint32_t hash(const char* key, size_t count);
+	void migrate(size_t count);
+	size_t get_migrate_count(size_t pending);
+	void map_generations();
+	uint64_t hash(const char* key, size_t count);
 	IPC_Lock get_lock(bool is_writing);
+	void wait_for_recovery();
 
 	/**
 	* Private Members
 	*/
 	IPC_KV_Controller* m_controller = nullptr;
+	IPC_KV_Controller* m_old_controller = nullptr;
+	IPC_KV_Stats_Slot* m_stats = nullptr;
 	std::string m_name;
 	size_t m_resize_count;
+	IPC_KV_Probing m_probing;
+	bool m_is_ordered;
+	bool m_is_cache;
+	bool m_is_observer = false;
+
+	// Persistent stores only. Held exclusively while opening or closing,
+	// and shared for as long as the instance is attached.
+	IPC_Handle m_open_lock = IPCKV_INVALID_HANDLE;
+	IPC_Handle m_attach_lock = IPCKV_INVALID_HANDLE;
+};
+
+/**
+* A snapshot file starts with this header, followed by m_count records of
+* a 32-bit key size, a 64-bit value size, a 64-bit expiry time, the key and
+* the value, in the byte order of the host. m_checksum chains wyhash over
+* the records.
+*/
+struct IPC_KV_Snapshot_Header
+{
+	uint32_t m_magic;
+	uint32_t m_version;
+	uint64_t m_count;
+	uint64_t m_checksum;
 };
 
+#define IPCKV_SNAPSHOT_RECORD_PREFIX (sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint64_t))
+
 enum IPC_KV_Data_State
 {
 	Empty = 0,
@@ -84,20 +528,242 @@ struct IPC_KV_Data
 {
 	IPC_KV_Data_State m_state[2];
 
-	char m_key[2][IPCKV_KEY_SIZE];
-	unsigned char m_value[2][IPCKV_DATA_SIZE];
+	// Heap reference of the block holding the key and value.
+	uint64_t m_block[2];
 
-	size_t m_size[2];
+	// Full hash of the key, compared before the key itself
+	// and reused when the slot moves to a new generation.
+	uint64_t m_hash[2];
+
+	// When the key expires in milliseconds since the epoch, zero if never.
+	// Wall-clock time, so that it holds across processes and restarts.
+	uint64_t m_expiry[2];
+
+	// Bumped on every commit, the low bit selects the active buffer.
+	// Lock-free readers use it as a sequence counter.
+	std::atomic<uint32_t> m_buffer_state;
+};
+
+/**
+* Key and value storage, allocated from the heap.
+*
+* A block is a header followed by the key and then the value, rounded up
+* to a power of two size class. Blocks are addressed by heap references,
+* the chunk index plus one above IPCKV_HEAP_CHUNK_SHIFT and the offset
+* into the chunk below it, so that zero is never a valid reference.
+*/
+struct IPC_KV_Block
+{
+	uint16_t m_size_class;
+	uint16_t m_key_size;
+	uint32_t m_value_size;
+
+	// Version of the value, see IPC_KV::get. Free blocks
+	// link to the next free block of their class instead.
+	union
+	{
+		uint64_t m_version;
+		uint64_t m_next;
+	};
+};
+
+static_assert(sizeof(IPC_KV_Block) == 16, "block headers must stay 16 bytes.");
+
+/**
+* The heap grows in chunks, each its own segment, which are carved into
+* blocks in order, m_chunk_current from m_chunk_used onwards. Freed blocks
+* go on a free list per size class. Only ever touched under the write lock.
+*/
+struct IPC_KV_Heap
+{
+	std::atomic<uint64_t> m_chunk_count;
+	uint64_t m_chunk_size[IPCKV_HEAP_MAX_CHUNKS];
+	uint64_t m_chunk_current;
+	uint64_t m_chunk_used;
+
+	uint64_t m_free[IPCKV_HEAP_CLASSES];
 
-	char m_buffer_state;
+	// Atomic so that stats can read it without the lock.
+	std::atomic<uint64_t> m_live_bytes;
+};
+
+/**
+* Skiplist keeping the keys of an ordered store in order. Its nodes are heap
+* blocks linked by heap reference, a node is the block header, the level of
+* the node where a value block has its size, a link per level and the key.
+* Only ever touched under the lock.
+*/
+struct IPC_KV_Index
+{
+	uint64_t m_head[IPCKV_INDEX_LEVELS];
+};
+
+/**
+* A heap chunk as mapped by one instance.
+*/
+struct IPC_KV_Chunk
+{
+	void* m_buffer;
+	IPC_Handle m_handle;
+	size_t m_size;
+};
+
+/**
+* Reader-writer lock living in shared memory.
+*
+* Readers announce themselves in one of IPCKV_LOCK_READER_SLOTS counters,
+* each on its own cache line, so they never contend on a shared word. A
+* slot holds the readers of one process at a time. Writers are admitted
+* in order by a ticket lock. The writer being served claims m_writer, which
+* turns new readers away, and then waits for every slot to drain.
+*
+* Both record the process they belong to, so that waiters can let go of
+* what a process that died was holding. Writers also record their process
+* next to their ticket in m_ticket_owners, so that the turn of one that died
+* waiting is passed over. A writer that died may have left the store
+* halfway through a change, which m_is_abandoned tells whoever takes the
+* lock next, see IPC_KV::get_lock.
+*/
+struct alignas(64) IPC_RW_Lock_Slot
+{
+	// The process that last read through the slot in the upper half, the
+	// number of its readers in the lower one. Another process can take the
+	// slot over once the count is zero.
+	std::atomic<uint64_t> m_readers;
+
+	// Bumped when the slot drains while a writer is waiting for it.
+	std::atomic<uint32_t> m_drained;
+};
+
+struct IPC_RW_Lock
+{
+	alignas(64) std::atomic<uint32_t> m_next_ticket;
+	alignas(64) std::atomic<uint32_t> m_now_serving;
+
+	// Process holding the write lock, zero if none.
+	alignas(64) std::atomic<uint32_t> m_writer;
+	alignas(64) std::atomic<uint32_t> m_sleepers;
+	std::atomic<uint32_t> m_is_abandoned;
+
+	// The ticket in the upper half, the process that took it in the lower
+	// one, at the ticket modulo IPCKV_LOCK_TICKETS.
+	std::atomic<uint64_t> m_ticket_owners[IPCKV_LOCK_TICKETS];
+
+	IPC_RW_Lock_Slot m_slots[IPCKV_LOCK_READER_SLOTS];
+};
+
+/**
+* Counters of one instance, on cache lines of their own so that instances
+* never write to each other's. They are bumped with a relaxed load and store
+* rather than an atomic add, which keeps stats off the lock-free read path
+* at the price of losing counts when threads share an instance.
+*/
+struct alignas(64) IPC_KV_Stats_Slot
+{
+	// Process of the instance the slot belongs to, zero if it is free.
+	std::atomic<uint32_t> m_process_id;
+
+	std::atomic<uint64_t> m_gets;
+	std::atomic<uint64_t> m_hits;
+	std::atomic<uint64_t> m_misses;
+	std::atomic<uint64_t> m_sets;
+	std::atomic<uint64_t> m_removes;
+	std::atomic<uint64_t> m_expirations;
+	std::atomic<uint64_t> m_evictions;
+	std::atomic<uint64_t> m_probes[IPCKV_STATS_PROBE_BUCKETS];
+	std::atomic<uint64_t> m_locks;
+	std::atomic<uint64_t> m_lock_wait_ns;
+	std::atomic<uint64_t> m_resizes;
+	std::atomic<uint64_t> m_resize_ns;
+
+	static void add(std::atomic<uint64_t>& counter, uint64_t value = 1)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+	}
+};
+
+/**
+* Ring of the last IPCKV_EVENTS changes. The writer holding the lock fills
+* in the slot of the next event, marking it with the event's position plus
+* one once done and zero meanwhile, and then moves m_head on. Watchers read
+* slots without the lock and tell from the mark whether they read the event
+* they were after or one that overwrote it. m_signal changes along with
+* m_head and is what they sleep on.
+*/
+struct IPC_KV_Event_Slot
+{
+	std::atomic<uint64_t> m_sequence;
+	std::atomic<uint64_t> m_hash;
+	std::atomic<uint32_t> m_type;
+};
+
+struct IPC_KV_Events
+{
+	alignas(64) std::atomic<uint64_t> m_head;
+	std::atomic<uint32_t> m_signal;
+	std::atomic<uint32_t> m_waiters;
+
+	alignas(64) IPC_KV_Event_Slot m_slots[IPCKV_EVENTS];
 };
 
 struct IPC_KV_Info
 {
-	char m_buffer_state;
+	uint32_t m_magic;
+	uint32_t m_version;
+
+	// Set by the last instance to close a persistent store once everything
+	// has been written back, a store found without it has to be recovered.
+	std::atomic<uint32_t> m_is_clean;
+
+	alignas(64) IPC_RW_Lock m_lock;
+
+	alignas(64) std::atomic<uint32_t> m_buffer_state;
 	size_t m_capacity[2];
 	size_t m_size[2];
 	size_t m_resize_count[2];
+
+	// Capacity of the previous generation while its slots are
+	// being migrated, zero otherwise.
+	size_t m_old_capacity[2];
+
+	// Next slot of the previous generation to migrate,
+	// only used under the write lock.
+	size_t m_migrate_index;
+
+	// Deleted slots in the current generation, which lengthen probes
+	// as much as occupied ones. Only changed under the write lock,
+	// atomic so that stats can read it without.
+	std::atomic<size_t> m_tombstones;
+
+	// Next slot of the current generation to sweep, and whether any key
+	// was ever given a time to live, which spares sweeping otherwise.
+	size_t m_sweep_index;
+	bool m_has_expiry;
+
+	IPC_KV_Heap m_heap;
+	IPC_KV_Index m_index;
+
+	IPC_KV_Probing m_probing;
+	bool m_is_ordered;
+
+	// Cache limits, zero for a store that grows, and the slot the
+	// CLOCK looks at next, in the old generation while migrating.
+	size_t m_max_entries;
+	size_t m_max_bytes;
+	size_t m_clock_hand;
+
+	// Id of the hash policy the store was created with, stored last
+	// by the creator so zero means the info is still being set up.
+	std::atomic<uint32_t> m_hash_policy;
+
+	// Number of attached IPC_KV instances, used to unlink
+	// the segments on platforms that keep them around.
+	std::atomic<uint32_t> m_attach_count;
+
+	// Slot 0 is shared by the instances that find the others taken.
+	IPC_KV_Stats_Slot m_stats[IPCKV_STATS_SLOTS];
+
+	IPC_KV_Events m_events;
 };
 
 class IPC_KV_Controller
@@ -107,17 +773,29 @@ public:
 
 	~IPC_KV_Controller()
 	{
-		if (m_data)
-			UnmapViewOfFile(m_data);
+		for (auto& chunk : m_chunks)
+		{
+			ipc_unmap_shared_memory(chunk.m_buffer, chunk.m_size);
+			ipc_close_handle(chunk.m_handle);
+		}
+
+		if (m_control)
+			ipc_unmap_shared_memory(m_control, m_data_size);
 
 		if (m_info)
-			UnmapViewOfFile(m_info);
+			ipc_unmap_shared_memory(m_info, sizeof(IPC_KV_Info));
+
+		if (m_data_handle != IPCKV_INVALID_HANDLE)
+			ipc_close_handle(m_data_handle);
 
-		if (m_data_handle)
-			CloseHandle(m_data_handle);
+		if (m_info_handle != IPCKV_INVALID_HANDLE)
+			ipc_close_handle(m_info_handle);
 
-		if (m_info_handle)
-			CloseHandle(m_info_handle);
+		if (m_lock_semaphore != IPCKV_INVALID_HANDLE)
+			ipc_close_handle(m_lock_semaphore);
+
+		if (m_event_semaphore != IPCKV_INVALID_HANDLE)
+			ipc_close_handle(m_event_semaphore);
 	}
 
 	// Disallow copying and moving.
@@ -137,6 +815,7 @@ public:
 		InfoResizeCount = (1 << 0),
 		InfoCapacity = (1 << 1),
 		InfoSize = (1 << 2),
+		InfoOldCapacity = (1 << 3),
 	};
 
 	/**
@@ -161,9 +840,12 @@ public:
 		if (!(m_info_transaction_flags & InfoTransaction::InfoSize))
 			setSize(getSize());
 
+		if (!(m_info_transaction_flags & InfoTransaction::InfoOldCapacity))
+			setOldCapacity(getOldCapacity());
+
 		/////////////////////////////////////////////////
 
-		InterlockedXor8(&m_info->m_buffer_state, IPCKV_BIT_HIGH);
+		m_info->m_buffer_state.fetch_add(1);
 
 		m_has_started_info_transaction = false;
 	}
@@ -188,7 +870,7 @@ public:
 		if (!m_has_started_info_transaction)
 			throw std::runtime_error("a info transaction has not been started.");
 
-		bool buffer_state = !InterlockedAnd8(&m_info->m_buffer_state, IPCKV_BIT_HIGH);
+		bool buffer_state = !(m_info->m_buffer_state.load() & IPCKV_BIT_HIGH);
 
 		m_info->m_resize_count[buffer_state] = resize_count;
 		m_info_transaction_flags = (InfoTransaction)(m_info_transaction_flags | InfoTransaction::InfoResizeCount);
@@ -202,7 +884,7 @@ public:
 		if (!m_has_started_info_transaction)
 			throw std::runtime_error("a info transaction has not been started.");
 
-		bool buffer_state = !InterlockedAnd8(&m_info->m_buffer_state, IPCKV_BIT_HIGH);
+		bool buffer_state = !(m_info->m_buffer_state.load() & IPCKV_BIT_HIGH);
 
 		m_info->m_capacity[buffer_state] = capacity;
 		m_info_transaction_flags = (InfoTransaction)(m_info_transaction_flags | InfoTransaction::InfoCapacity);
@@ -216,12 +898,26 @@ public:
 		if (!m_has_started_info_transaction)
 			throw std::runtime_error("a info transaction has not been started.");
 
-		bool buffer_state = !InterlockedAnd8(&m_info->m_buffer_state, IPCKV_BIT_HIGH);
+		bool buffer_state = !(m_info->m_buffer_state.load() & IPCKV_BIT_HIGH);
 
 		m_info->m_size[buffer_state] = size;
 		m_info_transaction_flags = (InfoTransaction)(m_info_transaction_flags | InfoTransaction::InfoSize);
 	}
 
+	void setOldCapacity(size_t old_capacity)
+	{
+		if (!m_info)
+			throw std::runtime_error("class is in an invalid state.");
+
+		if (!m_has_started_info_transaction)
+			throw std::runtime_error("a info transaction has not been started.");
+
+		bool buffer_state = !(m_info->m_buffer_state.load() & IPCKV_BIT_HIGH);
+
+		m_info->m_old_capacity[buffer_state] = old_capacity;
+		m_info_transaction_flags = (InfoTransaction)(m_info_transaction_flags | InfoTransaction::InfoOldCapacity);
+	}
+
 	/**
 	* m_Data Setters
 	*/
@@ -230,15 +926,18 @@ public:
 	{
 		DataNone = 0,
 		DataState = (1 << 0),
-		DataKey = (1 << 1),
-		DataValue = (1 << 2),
-		DataSize = (1 << 3),
+		DataBlock = (1 << 1),
+		DataHash = (1 << 2),
+		DataExpiry = (1 << 3),
 	};
 
 	/**
 	* Commit Data
+	*
+	* Frees the block the slot referenced before the commit if the
+	* transaction replaced it.
 	*/
-	void commitData(size_t index)
+	void commitData(size_t index, bool should_free = true)
 	{
 		if (!m_data)
 			throw std::runtime_error("class is in an invalid state.");
@@ -248,21 +947,26 @@ public:
 
 		/////////////////////////////////////////////////
 
-		if (!(m_data_transaction_flags & DataTransaction::DataSize))
-			setDataSize(index, getDataSize(index));
-
 		if (!(m_data_transaction_flags & DataTransaction::DataState))
 			setDataState(index, getDataState(index));
 
-		if (!(m_data_transaction_flags & DataTransaction::DataValue))
-			setData(index, getData(index), getDataSize(index));
+		if (!(m_data_transaction_flags & DataTransaction::DataBlock))
+			setDataBlock(index, getDataBlock(index));
+
+		if (!(m_data_transaction_flags & DataTransaction::DataHash))
+			setDataHash(index, getDataHash(index));
 
-		if (!(m_data_transaction_flags & DataTransaction::DataKey))
-			setDataKey(index, getDataKey(index), strlen(getDataKey(index)));
+		if (!(m_data_transaction_flags & DataTransaction::DataExpiry))
+			setDataExpiry(index, getDataExpiry(index));
 
 		///////////////////////////////////////////////// 
 
-		InterlockedXor8(&m_data[index].m_buffer_state, IPCKV_BIT_HIGH);
+		auto previous_block = getDataBlock(index);
+
+		m_data[index].m_buffer_state.fetch_add(1);
+
+		if (should_free && previous_block && previous_block != getDataBlock(index))
+			freeBlock(previous_block);
 
 		m_has_started_data_transaction = false;
 	}
@@ -279,256 +983,1411 @@ public:
 		m_data_transaction_flags = DataTransaction::DataNone;
 	}
 
-	void setDataSize(size_t index, size_t size)
+	void setDataState(size_t index, IPC_KV_Data_State state)
 	{
 		if (!m_data)
 			throw std::runtime_error("class is in an invalid state.");
 
-		bool buffer_state = !InterlockedAnd8(&m_data[index].m_buffer_state, IPCKV_BIT_HIGH);
+		bool buffer_state = !(m_data[index].m_buffer_state.load() & IPCKV_BIT_HIGH);
 
-		m_data[index].m_size[buffer_state] = size;
-		m_data_transaction_flags = (DataTransaction)(m_data_transaction_flags | DataTransaction::DataSize);
+		m_data[index].m_state[buffer_state] = state;
+		m_data_transaction_flags = (DataTransaction)(m_data_transaction_flags | DataTransaction::DataState);
 	}
 
-	void setDataState(size_t index, IPC_KV_Data_State state)
+	void setDataBlock(size_t index, uint64_t block)
 	{
 		if (!m_data)
 			throw std::runtime_error("class is in an invalid state.");
 
-		bool buffer_state = !InterlockedAnd8(&m_data[index].m_buffer_state, IPCKV_BIT_HIGH);
+		bool buffer_state = !(m_data[index].m_buffer_state.load() & IPCKV_BIT_HIGH);
 
-		m_data[index].m_state[buffer_state] = state;
-		m_data_transaction_flags = (DataTransaction)(m_data_transaction_flags | DataTransaction::DataState);
+		m_data[index].m_block[buffer_state] = block;
+		m_data_transaction_flags = (DataTransaction)(m_data_transaction_flags | DataTransaction::DataBlock);
 	}
 
-	void setData(size_t index, unsigned char* data, size_t size)
+	void setDataHash(size_t index, uint64_t hashCode)
 	{
 		if (!m_data)
 			throw std::runtime_error("class is in an invalid state.");
 
-		bool buffer_state = !InterlockedAnd8(&m_data[index].m_buffer_state, IPCKV_BIT_HIGH);
+		bool buffer_state = !(m_data[index].m_buffer_state.load() & IPCKV_BIT_HIGH);
 
-		memcpy_s(m_data[index].m_value[buffer_state], IPCKV_DATA_SIZE, data, size);
-		m_data[index].m_size[buffer_state] = size;
-
-		m_data_transaction_flags = (DataTransaction)(m_data_transaction_flags | DataTransaction::DataValue);
-		m_data_transaction_flags = (DataTransaction)(m_data_transaction_flags | DataTransaction::DataSize);
+		m_data[index].m_hash[buffer_state] = hashCode;
+		m_data_transaction_flags = (DataTransaction)(m_data_transaction_flags | DataTransaction::DataHash);
 	}
 
-	void setDataKey(size_t index, const char* key, size_t size)
+	void setDataExpiry(size_t index, uint64_t expiry)
 	{
 		if (!m_data)
 			throw std::runtime_error("class is in an invalid state.");
 
-		bool buffer_state = !InterlockedAnd8(&m_data[index].m_buffer_state, IPCKV_BIT_HIGH);
-
-		strncpy_s(m_data[index].m_key[buffer_state], key, size);
+		bool buffer_state = !(m_data[index].m_buffer_state.load() & IPCKV_BIT_HIGH);
 
-		m_data_transaction_flags = (DataTransaction)(m_data_transaction_flags | DataTransaction::DataKey);
+		m_data[index].m_expiry[buffer_state] = expiry;
+		m_data_transaction_flags = (DataTransaction)(m_data_transaction_flags | DataTransaction::DataExpiry);
 	}
 
 	/**
-	* m_info Getters
+	* Segments
+	*
+	* Shared memory, or files in m_directory for persistent stores.
 	*/
 
-	size_t getCapacity()
-	{
-		if (!m_info)
-			throw std::runtime_error("class is in an invalid state.");
-
-		bool buffer_state = InterlockedAnd8(&m_info->m_buffer_state, IPCKV_BIT_HIGH);
-
-		return m_info->m_capacity[buffer_state];
-	}
-
-	size_t getSize()
+	void* mapSegment(const std::string& name, size_t size, IPC_Handle& handle, bool& does_already_exist, bool can_create = true)
 	{
-		if (!m_info)
-			throw std::runtime_error("class is in an invalid state.");
+		if (m_heap_owner)
+			return m_heap_owner->mapSegment(name, size, handle, does_already_exist, can_create);
 
-		bool buffer_state = InterlockedAnd8(&m_info->m_buffer_state, IPCKV_BIT_HIGH);
+		if (m_directory.empty())
+			return ipc_map_shared_memory(name, size, handle, does_already_exist, can_create);
 
-		return m_info->m_size[buffer_state];
+		return ipc_map_file(m_directory + "/" + name, size, handle, does_already_exist, can_create);
 	}
 
-	size_t getResizeCount()
+	void unlinkSegment(const std::string& name)
 	{
-		if (!m_info)
-			throw std::runtime_error("class is in an invalid state.");
-
-		bool buffer_state = InterlockedAnd8(&m_info->m_buffer_state, IPCKV_BIT_HIGH);
+		if (m_heap_owner)
+			return m_heap_owner->unlinkSegment(name);
 
-		return m_info->m_resize_count[buffer_state];
+		if (m_directory.empty())
+			ipc_unlink_shared_memory(name);
+		else
+			ipc_unlink_file(m_directory + "/" + name);
 	}
 
 	/**
-	* m_data Getters
+	* m_info->m_heap Allocation
+	*
+	* Must be called with the write lock held.
 	*/
 
-	unsigned char* getData(size_t index)
+	std::string getChunkName(size_t chunk)
 	{
-		if (!m_data)
-			throw std::runtime_error("class is in an invalid state.");
-
-		bool buffer_state = InterlockedAnd8(&m_data[index].m_buffer_state, IPCKV_BIT_HIGH);
-
-		return m_data[index].m_value[buffer_state];
+		return "ipckv_h_" + std::to_string(chunk) + "_" + m_name;
 	}
 
-	size_t getDataSize(size_t index)
+	/**
+	* Allocates a block and fills it with the key and value.
+	*/
+	uint64_t createBlock(const char* key, size_t key_size, unsigned char* data, size_t size, uint64_t version)
 	{
-		if (!m_data)
-			throw std::runtime_error("class is in an invalid state.");
+		if (size > IPCKV_DATA_SIZE)
+			throw std::runtime_error("data size is too big");
 
-		bool buffer_state = InterlockedAnd8(&m_data[index].m_buffer_state, IPCKV_BIT_HIGH);
+		if (key_size >= IPCKV_KEY_SIZE)
+			throw std::runtime_error("key size is too big");
 
-		return m_data[index].m_size[buffer_state];
-	}
+		auto reference = allocateBlock(sizeof(IPC_KV_Block) + key_size + size);
+		auto block = getBlock(reference);
 
-	IPC_KV_Data_State getDataState(size_t index)
-	{
-		if (!m_data)
-			throw std::runtime_error("class is in an invalid state.");
+		block->m_key_size = uint16_t(key_size);
+		block->m_value_size = uint32_t(size);
+		block->m_version = version;
 
-		bool buffer_state = InterlockedAnd8(&m_data[index].m_buffer_state, IPCKV_BIT_HIGH);
+		std::memcpy(block + 1, key, key_size);
+		std::memcpy((char*)(block + 1) + key_size, data, size);
 
-		return m_data[index].m_state[buffer_state];
+		return reference;
 	}
 
-	char* getDataKey(size_t index)
+	uint64_t allocateBlock(size_t size)
 	{
-		if (!m_data)
-			throw std::runtime_error("class is in an invalid state.");
+		if (m_heap_owner)
+			return m_heap_owner->allocateBlock(size);
 
-		bool buffer_state = InterlockedAnd8(&m_data[index].m_buffer_state, IPCKV_BIT_HIGH);
+		if (!m_info)
+			throw std::runtime_error("class is in an invalid state.");
 
-		return m_data[index].m_key[buffer_state];
-	}
+		auto& heap = m_info->m_heap;
 
-	bool m_has_started_info_transaction = false;
-	InfoTransaction m_info_transaction_flags = InfoTransaction::InfoNone;
+		size_t size_class = 0;
 
-	bool m_has_started_data_transaction = false;
-	DataTransaction m_data_transaction_flags = DataTransaction::DataNone;
+		while ((1ull << (size_class + IPCKV_HEAP_MIN_SHIFT)) < size)
+			size_class++;
 
-	IPC_KV_Info* m_info = nullptr;
-	IPC_KV_Data* m_data = nullptr;
+		if (size_class >= IPCKV_HEAP_CLASSES)
+			throw std::runtime_error("block size is too big");
 
-	HANDLE m_info_handle = nullptr;
-	HANDLE m_data_handle = nullptr;
-};
+		uint64_t block_size = 1ull << (size_class + IPCKV_HEAP_MIN_SHIFT);
+		uint64_t reference = heap.m_free[size_class];
 
-class IPC_Lock {
-public:
-	IPC_Lock(bool is_write_lock, const std::string& name)
-	{
-		if (is_write_lock)
+		if (reference)
 		{
-			if (name.length() > MAX_PATH)
+			heap.m_free[size_class] = getBlock(reference)->m_next;
+		}
+		else
+		{
+			while (
+				heap.m_chunk_current >= heap.m_chunk_count.load()
+				|| heap.m_chunk_used + block_size > heap.m_chunk_size[heap.m_chunk_current]
+				)
 			{
-				throw std::runtime_error("rwlock name too long.");
+				nextChunk(block_size);
 			}
 
-			auto mutex_name = name + "_mutex";
+			reference = ((heap.m_chunk_current + 1) << IPCKV_HEAP_CHUNK_SHIFT) | heap.m_chunk_used;
 
-			mutex_handle = CreateMutexA(
-				nullptr,
-				FALSE,
-				mutex_name.c_str()
-			);
+			// Headers go in before the block is carved, so that
+			// recovery can always walk a chunk up to m_chunk_used.
+			getBlock(reference)->m_size_class = uint16_t(size_class);
+			heap.m_chunk_used += block_size;
+		}
 
-			if (mutex_handle == nullptr)
-			{
-				throw std::runtime_error("could not create mutex.");
-			}
+		heap.m_live_bytes += block_size;
 
-			auto wait_result = WaitForSingleObject(mutex_handle, INFINITE);
+		return reference;
+	}
 
-			if (wait_result != WAIT_OBJECT_0)
-				throw std::runtime_error("failed to wait for semaphore object");
+	void freeBlock(uint64_t reference)
+	{
+		if (m_heap_owner)
+			return m_heap_owner->freeBlock(reference);
 
-			//////////////////////////////////////////////
+		if (!m_info)
+			throw std::runtime_error("class is in an invalid state.");
 
-			semaphore_handle = CreateSemaphoreA(
-				nullptr,
-				0,
-				IPCKV_MAX_LOCKS,
-				name.c_str()
-			);
+		auto& heap = m_info->m_heap;
+		auto block = getBlock(reference);
 
-			if (semaphore_handle == nullptr)
-			{
-				throw std::runtime_error("could not create rwlock.");
-			}
+		block->m_next = heap.m_free[block->m_size_class];
+		heap.m_free[block->m_size_class] = reference;
+		heap.m_live_bytes -= 1ull << (block->m_size_class + IPCKV_HEAP_MIN_SHIFT);
+	}
 
-			if (GetLastError() == ERROR_ALREADY_EXISTS)
-			{
-				for (int i = 0; i < IPCKV_MAX_LOCKS; i++)
-				{
-					auto wait_result = WaitForSingleObject(semaphore_handle, INFINITE);
+	/**
+	* Moves on to the next chunk, after handing whatever is left of the
+	* current one to the free lists, and creates it if it does not exist.
+	*/
+	void nextChunk(uint64_t block_size)
+	{
+		auto& heap = m_info->m_heap;
 
-					if (wait_result != WAIT_OBJECT_0)
-						throw std::runtime_error("failed to wait for semaphore object");
-				}
-			}
-		}
-		else
+		if (heap.m_chunk_current < heap.m_chunk_count.load())
 		{
-			if (name.length() > MAX_PATH)
+			auto remaining = heap.m_chunk_size[heap.m_chunk_current] - heap.m_chunk_used;
+
+			for (int size_class = IPCKV_HEAP_CLASSES - 1; size_class >= 0; size_class--)
 			{
-				throw std::runtime_error("rwlock name too long.");
-			}
+				uint64_t size = 1ull << (size_class + IPCKV_HEAP_MIN_SHIFT);
 
-			semaphore_handle = CreateSemaphoreA(
-				nullptr,
-				IPCKV_MAX_LOCKS,
-				IPCKV_MAX_LOCKS,
-				name.c_str()
-			);
+				while (remaining >= size)
+				{
+					uint64_t reference = ((heap.m_chunk_current + 1) << IPCKV_HEAP_CHUNK_SHIFT) | heap.m_chunk_used;
 
-			if (semaphore_handle == nullptr)
-			{
-				throw std::runtime_error("could not create rwlock.");
-			}
+					getBlock(reference)->m_size_class = uint16_t(size_class);
+					getBlock(reference)->m_next = heap.m_free[size_class];
+					heap.m_free[size_class] = reference;
 
-			auto wait_result = WaitForSingleObject(semaphore_handle, INFINITE);
+					heap.m_chunk_used += size;
+					remaining -= size;
+				}
+			}
 
-			if (wait_result != WAIT_OBJECT_0)
-				throw std::runtime_error("failed to wait for single object");
+			heap.m_chunk_current++;
+			heap.m_chunk_used = 0;
 		}
 
+		if (heap.m_chunk_current >= heap.m_chunk_count.load())
+			addChunk(block_size);
 	}
 
-	~IPC_Lock() noexcept
+	/**
+	* Creates a chunk big enough for block_size.
+	*/
+	void addChunk(uint64_t block_size)
 	{
-		if (semaphore_handle)
-		{
-			ReleaseSemaphore(semaphore_handle, IPCKV_MAX_LOCKS, nullptr);
-			CloseHandle(semaphore_handle);
-		}
+		auto& heap = m_info->m_heap;
+		auto chunk = heap.m_chunk_count.load();
 
-		if (mutex_handle)
-		{
-			ReleaseMutex(mutex_handle);
-			CloseHandle(mutex_handle);
-		}
-	}
+		if (chunk >= IPCKV_HEAP_MAX_CHUNKS)
+			throw std::runtime_error("heap is full.");
 
-	IPC_Lock(const IPC_Lock&) = delete;
-	IPC_Lock& operator=(IPC_Lock const&) = delete;
+		uint64_t chunk_size = std::max<uint64_t>(std::min<uint64_t>(IPCKV_HEAP_CHUNK_SIZE << chunk, IPCKV_HEAP_MAX_CHUNK_SIZE), block_size);
 
-	IPC_Lock(IPC_Lock&& ipc_write_lock) noexcept :
-		semaphore_handle(std::exchange(ipc_write_lock.semaphore_handle, nullptr)),
-		mutex_handle(std::exchange(ipc_write_lock.mutex_handle, nullptr)) { }
+		IPC_Handle handle;
+		bool does_already_exist;
 
-	IPC_Lock& operator=(IPC_Lock&& ipc_write_lock)
-	{
-		semaphore_handle = std::exchange(ipc_write_lock.semaphore_handle, nullptr);
-		mutex_handle = std::exchange(ipc_write_lock.mutex_handle, nullptr);
+		auto buffer = mapSegment(getChunkName(chunk), chunk_size, handle, does_already_exist);
+
+		if (buffer == nullptr)
+			throw std::runtime_error("could not map view of file.");
+
+		m_chunks.push_back({ buffer, handle, size_t(chunk_size) });
+
+		heap.m_chunk_size[chunk] = chunk_size;
+		heap.m_chunk_count.store(chunk + 1);
+	}
+
+	/**
+	* Frees every block at once, the chunks stay around and are
+	* carved again from the first one.
+	*/
+	void resetHeap()
+	{
+		if (m_heap_owner)
+			return m_heap_owner->resetHeap();
+
+		if (!m_info)
+			throw std::runtime_error("class is in an invalid state.");
+
+		auto& heap = m_info->m_heap;
+
+		heap.m_chunk_current = 0;
+		heap.m_chunk_used = 0;
+		heap.m_live_bytes = 0;
+
+		std::fill(std::begin(heap.m_free), std::end(heap.m_free), 0);
+	}
+
+	/**
+	* Control Bytes
+	*
+	* The data mapping starts with one control byte per slot, mirroring
+	* the slot state plus seven bits of its hash for full slots, so that
+	* probing scans a compact array and only compares the keys of slots
+	* whose fingerprint matches. Groups of IPCKV_GROUP_WIDTH bytes are
+	* matched at once and may start at any slot, the first bytes are
+	* repeated past the end so a group never has to wrap around.
+	*/
+
+	static size_t getControlSize(size_t capacity)
+	{
+		return (capacity + IPCKV_GROUP_WIDTH + 63) & ~size_t(63);
+	}
+
+	/**
+	* Followed by one reference byte per slot, which readers of a cache set
+	* without the lock when they find a key and the CLOCK clears as it goes.
+	*/
+	static size_t getReferenceSize(size_t capacity)
+	{
+		return (capacity + 63) & ~size_t(63);
+	}
+
+	static size_t getMappingSize(size_t capacity)
+	{
+		return getControlSize(capacity) + getReferenceSize(capacity) + sizeof(IPC_KV_Data) * capacity;
+	}
+
+	// The top bits, the low ones pick the probe position.
+	static uint8_t getControlFingerprint(uint64_t hashCode)
+	{
+		return uint8_t(IPCKV_CONTROL_FULL | (hashCode >> 57));
+	}
+
+	void setDataMapping(uint8_t* buffer, IPC_Handle handle, size_t capacity)
+	{
+		m_control = buffer;
+		m_reference = (std::atomic<uint8_t>*)(buffer + getControlSize(capacity));
+		m_data = (IPC_KV_Data*)(buffer + getControlSize(capacity) + getReferenceSize(capacity));
+		m_data_handle = handle;
+		m_data_size = getMappingSize(capacity);
+		m_data_capacity = capacity;
+	}
+
+	/**
+	* Returns a mask with bit i set if the control byte of the
+	* slot position + i is equal to value.
+	*/
+	uint32_t matchControl(size_t position, uint8_t value)
+	{
+		if (!m_control)
+			throw std::runtime_error("class is in an invalid state.");
+
+		auto group = m_control + position;
+
+#ifdef IPCKV_SSE2
+		auto mask = uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i*)group),
+			_mm_set1_epi8(char(value))
+		)));
+#else
+		uint32_t mask = 0;
+
+		for (int i = 0; i < IPCKV_GROUP_WIDTH; i++)
+		{
+			if (group[i] == value)
+				mask |= 1u << i;
+		}
+#endif
+
+		// Pairs with the fence in setControl.
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		return mask;
+	}
+
+	// Only written if it is not set yet, which keeps hits from
+	// bouncing the cache line between the processes reading it.
+	void touchData(size_t index)
+	{
+		auto& reference = m_reference[index];
+
+		if (!reference.load(std::memory_order_relaxed))
+			reference.store(1, std::memory_order_relaxed);
+	}
+
+	void prefetchGroup(size_t position)
+	{
+		ipc_prefetch(m_control + position);
+		ipc_prefetch(m_data + position);
+	}
+
+	/**
+	* Sets the control byte of a slot from its state if it does not match,
+	* for recovery. Returns the state.
+	*/
+	IPC_KV_Data_State repairControl(size_t index)
+	{
+		auto state = getDataState(index);
+		uint8_t control = IPCKV_CONTROL_EMPTY;
+
+		if (state == IPC_KV_Data_State::Occupied)
+			control = getControlFingerprint(getDataHash(index));
+		else if (state == IPC_KV_Data_State::Deleted)
+			control = IPCKV_CONTROL_DELETED;
+
+		if (m_control[index] != control || (index < IPCKV_GROUP_WIDTH && m_control[m_data_capacity + index] != control))
+			setControl(index, control);
+
+		return state;
+	}
+
+	/**
+	* Must be called after the slot has been committed so that lock-free
+	* readers never find a fingerprint before the slot it leads to.
+	*/
+	void setControl(size_t index, uint8_t value)
+	{
+		if (!m_control)
+			throw std::runtime_error("class is in an invalid state.");
+
+		std::atomic_thread_fence(std::memory_order_release);
+
+		m_control[index] = value;
+
+		if (index < IPCKV_GROUP_WIDTH)
+			m_control[m_data_capacity + index] = value;
+	}
+
+	/**
+	* m_info Getters
+	*
+	* These are safe to call without the lock, a read that raced
+	* with a commit is simply retried.
+	*/
+
+	size_t readInfo(const size_t (&field)[2])
+	{
+		while (true)
+		{
+			auto sequence = m_info->m_buffer_state.load(std::memory_order_acquire);
+			auto value = field[sequence & IPCKV_BIT_HIGH];
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+
+			if (m_info->m_buffer_state.load(std::memory_order_relaxed) == sequence)
+				return value;
+		}
+	}
+
+	size_t getCapacity()
+	{
+		if (!m_info)
+			throw std::runtime_error("class is in an invalid state.");
+
+		return readInfo(m_info->m_capacity);
+	}
+
+	size_t getSize()
+	{
+		if (!m_info)
+			throw std::runtime_error("class is in an invalid state.");
+
+		return readInfo(m_info->m_size);
+	}
+
+	size_t getResizeCount()
+	{
+		if (!m_info)
+			throw std::runtime_error("class is in an invalid state.");
+
+		return readInfo(m_info->m_resize_count);
+	}
+
+	size_t getOldCapacity()
+	{
+		if (!m_info)
+			throw std::runtime_error("class is in an invalid state.");
+
+		return readInfo(m_info->m_old_capacity);
+	}
+
+	/**
+	* m_data Getters
+	*/
+
+	size_t getDataCapacity()
+	{
+		return m_data_capacity;
+	}
+
+	/**
+	* Maps the heap chunks up to chunk if they are not mapped yet,
+	* returns nullptr if the chunk does not exist.
+	*/
+	IPC_KV_Chunk* getChunk(size_t chunk)
+	{
+		if (m_heap_owner)
+			return m_heap_owner->getChunk(chunk);
+
+		if (!m_info)
+			throw std::runtime_error("class is in an invalid state.");
+
+		while (m_chunks.size() <= chunk)
+		{
+			auto index = m_chunks.size();
+
+			if (index >= m_info->m_heap.m_chunk_count.load())
+				return nullptr;
+
+			auto chunk_size = m_info->m_heap.m_chunk_size[index];
+
+			IPC_Handle handle;
+			bool does_already_exist;
+
+			auto buffer = mapSegment(getChunkName(index), chunk_size, handle, does_already_exist);
+
+			if (buffer == nullptr)
+				throw std::runtime_error("could not map view of file.");
+
+			m_chunks.push_back({ buffer, handle, size_t(chunk_size) });
+		}
+
+		return &m_chunks[chunk];
+	}
+
+	/**
+	* Resolves a heap reference. Lock-free readers may hold a reference
+	* torn by a concurrent commit, so this returns nullptr instead of
+	* pointing outside the chunk, along with how many bytes are left in
+	* the chunk after the block starts.
+	*/
+	IPC_KV_Block* findBlock(uint64_t reference, size_t& available)
+	{
+		auto chunk_index = reference >> IPCKV_HEAP_CHUNK_SHIFT;
+		auto offset = reference & ((1ull << IPCKV_HEAP_CHUNK_SHIFT) - 1);
+
+		if (chunk_index == 0 || chunk_index > IPCKV_HEAP_MAX_CHUNKS)
+			return nullptr;
+
+		auto chunk = getChunk(chunk_index - 1);
+
+		if (!chunk || offset + sizeof(IPC_KV_Block) > chunk->m_size)
+			return nullptr;
+
+		available = chunk->m_size - offset;
+
+		return (IPC_KV_Block*)((char*)chunk->m_buffer + offset);
+	}
+
+	/**
+	* True if reference leads to a block that holds together, for recovery.
+	*/
+	bool isValidBlock(uint64_t reference)
+	{
+		size_t available;
+
+		auto block = findBlock(reference, available);
+
+		if (!block || block->m_size_class >= IPCKV_HEAP_CLASSES || block->m_key_size >= IPCKV_KEY_SIZE)
+			return false;
+
+		uint64_t block_size = 1ull << (block->m_size_class + IPCKV_HEAP_MIN_SHIFT);
+
+		return block_size <= available
+			&& block->m_value_size <= IPCKV_DATA_SIZE
+			&& sizeof(IPC_KV_Block) + block->m_key_size + block->m_value_size <= block_size;
+	}
+
+	IPC_KV_Block* getBlock(uint64_t reference)
+	{
+		size_t available;
+
+		auto block = findBlock(reference, available);
+
+		if (!block)
+			throw std::runtime_error("invalid heap reference.");
+
+		return block;
+	}
+
+	/**
+	* Reads a slot without holding the lock. If the slot is occupied by key,
+	* which is only looked at if the stored hash equals hashCode, the value is copied into data, which holds size bytes on input, and
+	* size is set to the size of the value, expiry to when it expires and
+	* version to its version.
+	* The value is left out if it does not fit, which is up to the caller to
+	* check. Returns false if a
+	* writer committed to the slot while it was being read, in which case
+	* nothing read from it can be trusted and the caller should try again.
+	*/
+	bool readData(size_t index, const std::string& key, uint64_t hashCode, IPC_KV_Data_State& state, bool& is_match, unsigned char* data, size_t& size, uint64_t& expiry, uint64_t& version)
+	{
+		if (!m_data)
+			throw std::runtime_error("class is in an invalid state.");
+
+		auto& slot = m_data[index];
+		auto sequence = slot.m_buffer_state.load(std::memory_order_acquire);
+		bool buffer_state = sequence & IPCKV_BIT_HIGH;
+
+		state = slot.m_state[buffer_state];
+		expiry = slot.m_expiry[buffer_state];
+		is_match = false;
+
+		uint64_t value_size = 0;
+
+		if (state == IPC_KV_Data_State::Occupied && slot.m_hash[buffer_state] == hashCode)
+		{
+			size_t available;
+
+			auto block = findBlock(slot.m_block[buffer_state], available);
+
+			if (block)
+			{
+				// A torn block must not send us past the chunk.
+				uint64_t key_size = block->m_key_size;
+				value_size = block->m_value_size;
+
+				auto key_data = (const char*)(block + 1);
+
+				is_match = key_size == key.length()
+					&& key_size <= available - sizeof(IPC_KV_Block)
+					&& value_size <= available - sizeof(IPC_KV_Block) - key_size
+					&& std::memcmp(key_data, key.c_str(), key_size) == 0;
+
+				if (is_match && value_size <= size)
+					std::memcpy(data, key_data + key_size, value_size);
+
+				version = block->m_version;
+			}
+		}
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		if (slot.m_buffer_state.load(std::memory_order_relaxed) != sequence)
+			return false;
+
+		if (is_match)
+			size = value_size;
+
+		return true;
+	}
+
+	/**
+	* Reads the state, hash and, unless key is nullptr, the key of a slot
+	* without holding the lock, with the same retry rule as readData.
+	*/
+	bool readDataKey(size_t index, IPC_KV_Data_State& state, uint64_t& hashCode, std::string* key)
+	{
+		if (!m_data)
+			throw std::runtime_error("class is in an invalid state.");
+
+		auto& slot = m_data[index];
+		auto sequence = slot.m_buffer_state.load(std::memory_order_acquire);
+		bool buffer_state = sequence & IPCKV_BIT_HIGH;
+
+		state = slot.m_state[buffer_state];
+		hashCode = slot.m_hash[buffer_state];
+
+		if (key && state == IPC_KV_Data_State::Occupied)
+		{
+			size_t available;
+
+			auto block = findBlock(slot.m_block[buffer_state], available);
+
+			// A torn block must not send us past the chunk.
+			if (block && block->m_key_size < IPCKV_KEY_SIZE && block->m_key_size <= available - sizeof(IPC_KV_Block))
+				key->assign((const char*)(block + 1), block->m_key_size);
+			else
+				key->clear();
+		}
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		return slot.m_buffer_state.load(std::memory_order_relaxed) == sequence;
+	}
+
+	uint64_t getDataBlock(size_t index)
+	{
+		if (!m_data)
+			throw std::runtime_error("class is in an invalid state.");
+
+		bool buffer_state = m_data[index].m_buffer_state.load() & IPCKV_BIT_HIGH;
+
+		return m_data[index].m_block[buffer_state];
+	}
+
+	uint64_t getDataHash(size_t index)
+	{
+		if (!m_data)
+			throw std::runtime_error("class is in an invalid state.");
+
+		bool buffer_state = m_data[index].m_buffer_state.load() & IPCKV_BIT_HIGH;
+
+		return m_data[index].m_hash[buffer_state];
+	}
+
+	uint64_t getDataExpiry(size_t index)
+	{
+		if (!m_data)
+			throw std::runtime_error("class is in an invalid state.");
+
+		bool buffer_state = m_data[index].m_buffer_state.load() & IPCKV_BIT_HIGH;
+
+		return m_data[index].m_expiry[buffer_state];
+	}
+
+	unsigned char* getData(size_t index)
+	{
+		auto block = getBlock(getDataBlock(index));
+
+		return (unsigned char*)(block + 1) + block->m_key_size;
+	}
+
+	size_t getDataSize(size_t index)
+	{
+		return getBlock(getDataBlock(index))->m_value_size;
+	}
+
+	uint64_t getDataVersion(size_t index)
+	{
+		return getBlock(getDataBlock(index))->m_version;
+	}
+
+	IPC_KV_Data_State getDataState(size_t index)
+	{
+		if (!m_data)
+			throw std::runtime_error("class is in an invalid state.");
+
+		bool buffer_state = m_data[index].m_buffer_state.load() & IPCKV_BIT_HIGH;
+
+		return m_data[index].m_state[buffer_state];
+	}
+
+	std::string_view getDataKey(size_t index)
+	{
+		auto block = getBlock(getDataBlock(index));
+
+		return std::string_view((const char*)(block + 1), block->m_key_size);
+	}
+
+	/**
+	* m_info->m_index
+	*
+	* Must be called with the lock held, the write lock to change it.
+	*/
+
+	uint64_t* getIndexLinks(uint64_t node)
+	{
+		return (uint64_t*)(getBlock(node) + 1);
+	}
+
+	std::string_view getIndexKey(uint64_t node)
+	{
+		auto block = getBlock(node);
+
+		return std::string_view((const char*)((uint64_t*)(block + 1) + block->m_value_size), block->m_key_size);
+	}
+
+	/**
+	* Fills path with the last node before key on every level, zero standing
+	* for the head, and returns the first node not before it or zero.
+	*/
+	uint64_t seekIndex(std::string_view key, uint64_t (&path)[IPCKV_INDEX_LEVELS])
+	{
+		auto& index = m_info->m_index;
+		uint64_t node = 0;
+
+		for (int level = IPCKV_INDEX_LEVELS - 1; level >= 0; level--)
+		{
+			while (true)
+			{
+				auto next = node ? getIndexLinks(node)[level] : index.m_head[level];
+
+				if (!next || getIndexKey(next) >= key)
+					break;
+
+				node = next;
+			}
+
+			path[level] = node;
+		}
+
+		return node ? getIndexLinks(node)[0] : index.m_head[0];
+	}
+
+	uint64_t seekIndex(std::string_view key)
+	{
+		uint64_t path[IPCKV_INDEX_LEVELS];
+
+		return seekIndex(key, path);
+	}
+
+	uint64_t getIndexNext(uint64_t node)
+	{
+		return getIndexLinks(node)[0];
+	}
+
+	/**
+	* Allocates the node of a key about to be added. The level comes from
+	* the hash, so no process needs a random generator of its own, and is
+	* one higher one time in four.
+	*/
+	uint64_t createIndexNode(const std::string& key, uint64_t hashCode)
+	{
+		uint32_t level = std::min<uint32_t>(1 + ipc_count_trailing_zeros(uint32_t(hashCode >> 24) | (1u << 31)) / 2, IPCKV_INDEX_LEVELS);
+
+		auto node = allocateBlock(sizeof(IPC_KV_Block) + level * sizeof(uint64_t) + key.length());
+		auto block = getBlock(node);
+
+		block->m_key_size = uint16_t(key.length());
+		block->m_value_size = level;
+
+		std::memcpy((uint64_t*)(block + 1) + level, key.c_str(), key.length());
+
+		return node;
+	}
+
+	void insertIndexNode(uint64_t node)
+	{
+		auto& index = m_info->m_index;
+
+		uint64_t path[IPCKV_INDEX_LEVELS];
+		seekIndex(getIndexKey(node), path);
+
+		auto level = uint32_t(getBlock(node)->m_value_size);
+		auto links = getIndexLinks(node);
+
+		for (uint32_t i = 0; i < level; i++)
+		{
+			auto& previous = path[i] ? getIndexLinks(path[i])[i] : index.m_head[i];
+
+			links[i] = previous;
+			previous = node;
+		}
+	}
+
+	void removeIndexKey(std::string_view key)
+	{
+		auto& index = m_info->m_index;
+
+		uint64_t path[IPCKV_INDEX_LEVELS];
+		auto node = seekIndex(key, path);
+
+		if (!node || getIndexKey(node) != key)
+			return;
+
+		auto level = uint32_t(getBlock(node)->m_value_size);
+		auto links = getIndexLinks(node);
+
+		for (uint32_t i = 0; i < level; i++)
+		{
+			auto& previous = path[i] ? getIndexLinks(path[i])[i] : index.m_head[i];
+
+			previous = links[i];
+		}
+
+		freeBlock(node);
+	}
+
+	// The nodes go along with the rest of the heap.
+	void resetIndex()
+	{
+		auto& index = m_info->m_index;
+
+		std::fill(std::begin(index.m_head), std::end(index.m_head), 0);
+	}
+
+	/**
+	* m_info->m_events
+	*
+	* Must be called with the write lock held, see IPC_KV_Events. The head
+	* doubles as the version clock, the version of a value being that of
+	* the event publishing it.
+	*/
+	uint64_t getNextVersion()
+	{
+		return m_info->m_events.m_head.load(std::memory_order_relaxed) + 1;
+	}
+
+	void publishEvent(IPC_KV_Event_Type type, uint64_t hash)
+	{
+		auto& events = m_info->m_events;
+
+		auto sequence = events.m_head.load(std::memory_order_relaxed);
+		auto& slot = events.m_slots[sequence & (IPCKV_EVENTS - 1)];
+
+		slot.m_sequence.store(0, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		slot.m_hash.store(hash, std::memory_order_relaxed);
+		slot.m_type.store(uint32_t(type), std::memory_order_relaxed);
+		slot.m_sequence.store(sequence + 1, std::memory_order_release);
+
+		events.m_head.store(sequence + 1, std::memory_order_release);
+		events.m_signal.store(uint32_t(sequence + 1));
+
+		auto waiters = events.m_waiters.load();
+
+		if (waiters > 0)
+			ipc_futex_wake(&events.m_signal, waiters, m_event_semaphore);
+	}
+
+	bool m_has_started_info_transaction = false;
+	InfoTransaction m_info_transaction_flags = InfoTransaction::InfoNone;
+
+	bool m_has_started_data_transaction = false;
+	DataTransaction m_data_transaction_flags = DataTransaction::DataNone;
+
+	IPC_KV_Info* m_info = nullptr;
+	IPC_KV_Data* m_data = nullptr;
+	uint8_t* m_control = nullptr;
+	std::atomic<uint8_t>* m_reference = nullptr;
+
+	IPC_Handle m_info_handle = IPCKV_INVALID_HANDLE;
+	IPC_Handle m_data_handle = IPCKV_INVALID_HANDLE;
+
+	// Windows only, see ipc_futex_wait.
+	IPC_Handle m_lock_semaphore = IPCKV_INVALID_HANDLE;
+	IPC_Handle m_event_semaphore = IPCKV_INVALID_HANDLE;
+
+	size_t m_data_size = 0;
+	size_t m_data_capacity = 0;
+
+	std::vector<IPC_KV_Chunk> m_chunks;
+	std::string m_name;
+	std::string m_directory;
+
+	// Controllers of a previous generation only map its slots
+	// and go through the current controller for the heap.
+	IPC_KV_Controller* m_heap_owner = nullptr;
+};
+
+class IPC_Lock {
+public:
+	IPC_Lock(bool is_write_lock, IPC_RW_Lock* rw_lock, IPC_Handle semaphore = IPCKV_INVALID_HANDLE) :
+		rw_lock(rw_lock),
+		semaphore(semaphore),
+		is_write_lock(is_write_lock)
+	{
+		if (!rw_lock)
+		{
+			throw std::runtime_error("rwlock is in an invalid state.");
+		}
+
+		if (is_write_lock)
+			lock_exclusive();
+		else
+			lock_shared();
+	}
+
+	~IPC_Lock() noexcept
+	{
+		if (!rw_lock)
+			return;
+
+		if (is_write_lock)
+			unlock_exclusive();
+		else
+			unlock_shared();
+	}
+
+	IPC_Lock(const IPC_Lock&) = delete;
+	IPC_Lock& operator=(IPC_Lock const&) = delete;
+
+	IPC_Lock(IPC_Lock&& ipc_lock) noexcept :
+		rw_lock(std::exchange(ipc_lock.rw_lock, nullptr)),
+		reader_slot(ipc_lock.reader_slot),
+		ticket(ipc_lock.ticket),
+		semaphore(ipc_lock.semaphore),
+		is_write_lock(ipc_lock.is_write_lock) { }
+
+	IPC_Lock& operator=(IPC_Lock&& ipc_lock)
+	{
+		rw_lock = std::exchange(ipc_lock.rw_lock, nullptr);
+		reader_slot = ipc_lock.reader_slot;
+		ticket = ipc_lock.ticket;
+		semaphore = ipc_lock.semaphore;
+		is_write_lock = ipc_lock.is_write_lock;
 
 		return *this;
 	}
 private:
-	HANDLE semaphore_handle = nullptr;
-	HANDLE mutex_handle = nullptr;
-};
\ No newline at end of file
+	void lock_shared()
+	{
+		auto process_id = uint64_t(ipc_get_process_id()) << 32;
+
+		while (true)
+		{
+			auto writer = rw_lock->m_writer.load();
+
+			if (writer != 0)
+			{
+				wait(rw_lock->m_writer, writer);
+
+				if (rw_lock->m_writer.load() == writer)
+					reclaim_writer(writer);
+
+				continue;
+			}
+
+			// Writers waiting in line go first, the last of them
+			// wakes us through m_writer.
+			auto serving = rw_lock->m_now_serving.load();
+
+			if (serving != rw_lock->m_next_ticket.load())
+			{
+				wait_for_turn(rw_lock->m_writer, 0, serving);
+
+				continue;
+			}
+
+			reader_slot = enter_reader_slot(process_id);
+
+			if (!has_writers())
+				return;
+
+			// A writer showed up in between, let it through.
+			unlock_shared();
+		}
+	}
+
+	bool has_writers()
+	{
+		return rw_lock->m_writer.load() != 0 || rw_lock->m_now_serving.load() != rw_lock->m_next_ticket.load();
+	}
+
+	/**
+	* Counts the reader in on the first slot from its own on that no other
+	* process is counting readers in.
+	*/
+	IPC_RW_Lock_Slot* enter_reader_slot(uint64_t process_id)
+	{
+		auto start = get_reader_slot();
+
+		for (size_t i = 0; ; i++)
+		{
+			auto& slot = rw_lock->m_slots[(start + i) % IPCKV_LOCK_READER_SLOTS];
+			auto readers = slot.m_readers.load(std::memory_order_relaxed);
+
+			while ((readers & IPCKV_LOCK_COUNT_MASK) == 0 || (readers & ~IPCKV_LOCK_COUNT_MASK) == process_id)
+			{
+				if (slot.m_readers.compare_exchange_weak(readers, (readers & IPCKV_LOCK_COUNT_MASK) ? readers + 1 : process_id | 1))
+					return &slot;
+			}
+
+			// Other processes hold every slot.
+			if (i % IPCKV_LOCK_READER_SLOTS == IPCKV_LOCK_READER_SLOTS - 1)
+				std::this_thread::yield();
+		}
+	}
+
+	void unlock_shared()
+	{
+		// Nobody else takes the slot over while it is counting us.
+		auto readers = reader_slot->m_readers--;
+
+		if ((readers & IPCKV_LOCK_COUNT_MASK) == 1 && rw_lock->m_writer.load() != 0)
+		{
+			reader_slot->m_drained++;
+			wake(reader_slot->m_drained);
+		}
+	}
+
+	void lock_exclusive()
+	{
+		auto process_id = ipc_get_process_id();
+
+		take_ticket(process_id);
+
+		while (true)
+		{
+			auto serving = rw_lock->m_now_serving.load();
+
+			if (serving == ticket)
+			{
+				// Tickets only set the order, m_writer is what keeps
+				// writers apart, so a turn handed out wrongly is harmless.
+				uint32_t writer = 0;
+
+				if (rw_lock->m_writer.compare_exchange_strong(writer, process_id))
+					break;
+
+				wait(rw_lock->m_writer, writer);
+
+				if (rw_lock->m_writer.load() == writer)
+					reclaim_writer(writer);
+
+				continue;
+			}
+
+			// Passed over while we were not looking, line up again.
+			if (int32_t(serving - ticket) > 0)
+			{
+				take_ticket(process_id);
+
+				continue;
+			}
+
+			wait_for_turn(rw_lock->m_now_serving, serving, serving);
+		}
+
+		for (auto& slot : rw_lock->m_slots)
+		{
+			while (true)
+			{
+				auto drained = slot.m_drained.load();
+				auto readers = slot.m_readers.load();
+
+				if ((readers & IPCKV_LOCK_COUNT_MASK) == 0)
+					break;
+
+				wait(slot.m_drained, drained);
+
+				// Readers of a process that died never leave on their own,
+				// and only ever read, so their slot is simply freed.
+				if (slot.m_readers.load() == readers && !ipc_is_process_alive(uint32_t(readers >> 32)))
+					slot.m_readers.compare_exchange_strong(readers, 0);
+			}
+		}
+	}
+
+	void unlock_exclusive()
+	{
+		rw_lock->m_writer = 0;
+
+		// Unless our turn was passed over meanwhile.
+		auto serving = ticket;
+
+		if (rw_lock->m_now_serving.compare_exchange_strong(serving, ticket + 1))
+			wake(rw_lock->m_now_serving);
+
+		if (!has_writers())
+			wake(rw_lock->m_writer);
+	}
+
+	void take_ticket(uint32_t process_id)
+	{
+		ticket = rw_lock->m_next_ticket++;
+		rw_lock->m_ticket_owners[ticket % IPCKV_LOCK_TICKETS] = (uint64_t(ticket) << 32) | process_id;
+	}
+
+	/**
+	* Waits on word while serving is the turn being served, and moves the
+	* turn on when it is not being taken, see pass_over_ticket.
+	*/
+	void wait_for_turn(std::atomic<uint32_t>& word, uint32_t value, uint32_t serving)
+	{
+		if (serving != stale_serving)
+		{
+			stale_serving = serving;
+			stale_since = std::chrono::steady_clock::now();
+		}
+
+		wait(word, value);
+
+		if (rw_lock->m_now_serving.load() == serving)
+			pass_over_ticket(serving, std::chrono::steady_clock::now() - stale_since >= std::chrono::milliseconds(IPCKV_LOCK_STALE_MS));
+	}
+
+	/**
+	* Moves on from a turn that is not being taken, when the process that
+	* took the ticket died, or when that process is not known and the turn
+	* has been waiting for long. Its process lines up again if it is alive.
+	*/
+	void pass_over_ticket(uint32_t serving, bool is_stale)
+	{
+		auto owner = rw_lock->m_ticket_owners[serving % IPCKV_LOCK_TICKETS].load();
+		auto is_known = uint32_t(owner >> 32) == serving && (owner & IPCKV_LOCK_COUNT_MASK) != 0;
+
+		if (is_known ? ipc_is_process_alive(uint32_t(owner & IPCKV_LOCK_COUNT_MASK)) : !is_stale)
+			return;
+
+		LOG("Passing over ticket %u.\n", serving);
+
+		if (rw_lock->m_now_serving.compare_exchange_strong(serving, serving + 1))
+			wake(rw_lock->m_now_serving);
+	}
+
+	/**
+	* Lets go of the write lock of a process that died holding it.
+	*/
+	void reclaim_writer(uint32_t writer)
+	{
+		if (ipc_is_process_alive(writer))
+			return;
+
+		LOG("Writer %u died holding the lock.\n", writer);
+
+		rw_lock->m_is_abandoned = 1;
+
+		if (rw_lock->m_writer.compare_exchange_strong(writer, 0))
+			wake(rw_lock->m_writer);
+	}
+
+	/**
+	* Spins briefly, then sleeps until word moves away from value or
+	* IPCKV_LOCK_CHECK_MS have passed.
+	*/
+	void wait(std::atomic<uint32_t>& word, uint32_t value)
+	{
+		for (int i = 0; i < IPCKV_LOCK_SPIN; i++)
+		{
+			if (word.load(std::memory_order_relaxed) != value)
+				return;
+
+			ipc_cpu_relax();
+		}
+
+		rw_lock->m_sleepers++;
+		ipc_futex_wait(&word, value, IPCKV_LOCK_CHECK_MS, semaphore);
+		rw_lock->m_sleepers--;
+	}
+
+	void wake(std::atomic<uint32_t>& word)
+	{
+		auto sleepers = rw_lock->m_sleepers.load();
+
+		if (sleepers > 0)
+			ipc_futex_wake(&word, sleepers, semaphore);
+	}
+
+	/**
+	* Threads start looking from one slot, spread by process and thread id.
+	*/
+	static size_t get_reader_slot()
+	{
+		thread_local size_t slot = [] {
+			// Thread ids tend to be aligned addresses, mix them up first.
+			uint64_t id = std::hash<std::thread::id>()(std::this_thread::get_id()) ^ (uint64_t(ipc_get_process_id()) << 32);
+
+			id ^= id >> 33;
+			id *= 0xFF51AFD7ED558CCDull;
+			id ^= id >> 33;
+
+			return size_t(id % IPCKV_LOCK_READER_SLOTS);
+		}();
+
+		return slot;
+	}
+
+	IPC_RW_Lock* rw_lock = nullptr;
+	IPC_RW_Lock_Slot* reader_slot = nullptr;
+	uint32_t ticket = 0;
+
+	// The turn seen being served and since when, see wait_for_turn.
+	uint32_t stale_serving = UINT32_MAX;
+	std::chrono::steady_clock::time_point stale_since;
+
+	// Windows only, what waiters sleep on, see ipc_futex_wait.
+	IPC_Handle semaphore = IPCKV_INVALID_HANDLE;
+	bool is_write_lock = false;
+};
+
+/**
+* Read-only view of a value in place, as returned by IPC_KV::get_view.
+*
+* The view holds the read lock for as long as it lives, which keeps writers
+* and so any change to the value out. Keep it short-lived and do not call
+* back into the store from the thread holding it.
+*/
+class IPC_KV_View
+{
+public:
+	IPC_KV_View() {}
+
+	IPC_KV_View(IPC_Lock&& lock, const unsigned char* data, size_t size) :
+		m_lock(std::move(lock)),
+		m_data(data),
+		m_size(size) { }
+
+	// True if the key was found.
+	explicit operator bool() const
+	{
+		return m_data != nullptr;
+	}
+
+	const unsigned char* data() const
+	{
+		return m_data;
+	}
+
+	size_t size() const
+	{
+		return m_size;
+	}
+
+	std::string_view view() const
+	{
+		return std::string_view((const char*)m_data, m_size);
+	}
+private:
+	std::optional<IPC_Lock> m_lock;
+
+	const unsigned char* m_data = nullptr;
+	size_t m_size = 0;
+};
+
+/**
+* Lives in its own segment and records how many shards a sharded store was
+* created with, so that every process agrees on which shard a key is in.
+*/
+struct IPC_KV_Directory
+{
+	std::atomic<uint32_t> m_shard_count;
+	std::atomic<uint32_t> m_attach_count;
+};
+
+/**
+* A store split into a fixed number of independent IPC_KV shards, each with
+* its own info, lock, capacity and resize generation. Keys are spread over
+* the shards by their hash, so writers to different shards never wait on
+* each other and a resize only stalls the shard that is growing.
+*/
+class IPC_KV_Sharded
+{
+public:
+	/**
+	* Constructors and destructors
+	*/
+	IPC_KV_Sharded(const std::string& name, size_t shard_count, const IPC_KV_Options& options = IPC_KV_Options());
+	~IPC_KV_Sharded();
+
+	IPC_KV_Sharded(const IPC_KV_Sharded&) = delete;
+	IPC_KV_Sharded& operator=(const IPC_KV_Sharded&) = delete;
+
+	/**
+	* Public Methods
+	*/
+	void set(const std::string& key, unsigned char* data, size_t size);
+	void set(const std::string& key, unsigned char* data, size_t size, std::chrono::milliseconds ttl);
+	bool get(const std::string& key, unsigned char* data, size_t& size);
+	bool get(const std::string& key, unsigned char* data, size_t& size, uint64_t& version);
+	IPC_KV_View get_view(const std::string& key);
+	bool remove(const std::string& key);
+	size_t sweep(size_t count = IPCKV_SWEEP_BATCH);
+
+	// Versions are those of the shard holding the key.
+	uint64_t compare_and_set(const std::string& key, uint64_t expected_version, unsigned char* data, size_t size, std::chrono::milliseconds ttl = std::chrono::milliseconds(0));
+	uint64_t set_if_absent(const std::string& key, unsigned char* data, size_t size, std::chrono::milliseconds ttl = std::chrono::milliseconds(0));
+	int64_t fetch_add(const std::string& key, int64_t delta);
+
+	size_t multi_get(const std::vector<std::string>& keys, const std::function<void(size_t, const unsigned char*, size_t)>& callback);
+	void multi_set(const std::vector<std::string>& keys, const std::vector<std::string_view>& values);
+	size_t multi_remove(const std::vector<std::string>& keys);
+
+	// Walks the shards one after the other, a call never spans two.
+	std::vector<std::pair<std::string, std::string>> scan(IPC_KV_Cursor& cursor, size_t count = IPCKV_SCAN_COUNT);
+
+	// Merges the ranges of every shard, each under its own read lock.
+	std::vector<std::pair<std::string, std::string>> range(const std::string& begin, const std::string& end, size_t limit = SIZE_MAX);
+	std::vector<std::pair<std::string, std::string>> prefix(const std::string& prefix, size_t limit = SIZE_MAX);
+
+	void clear();
+	void print();
+	size_t size();
+	size_t shard_count();
+	IPC_KV_Stats stats();
+	void close();
+private:
+	/**
+	* Private Methods
+	*/
+	void initialize_directory(size_t shard_count);
+	IPC_KV& get_shard(const std::string& key);
+	size_t get_shard_index(const std::string& key);
+	std::vector<std::vector<size_t>> group_keys(const std::vector<std::string>& keys);
+	static std::vector<std::pair<std::string, std::string>> merge(std::vector<std::vector<std::pair<std::string, std::string>>>& runs, size_t limit);
+
+	/**
+	* Private Members
+	*/
+	std::vector<std::unique_ptr<IPC_KV>> m_shards;
+	std::string m_name;
+
+	// Directory of the files of a persistent store, empty otherwise.
+	std::string m_store_directory;
+
+	IPC_KV_Directory* m_directory = nullptr;
+	IPC_Handle m_directory_handle = IPCKV_INVALID_HANDLE;
+};
+
+/**
+* Background thread sweeping a store for expired keys, count slots every
+* interval, through an instance of its own so that it never shares one with
+* the threads of the process. Stops when destroyed.
+*/
+class IPC_KV_Sweeper
+{
+public:
+	IPC_KV_Sweeper(
+		const std::string& name, 
+		std::chrono::milliseconds interval = std::chrono::milliseconds(IPCKV_SWEEP_INTERVAL_MS),
+		size_t count = IPCKV_SWEEP_BATCH,
+		const IPC_KV_Options& options = IPC_KV_Options()
+	);
+	~IPC_KV_Sweeper();
+
+	IPC_KV_Sweeper(const IPC_KV_Sweeper&) = delete;
+	IPC_KV_Sweeper& operator=(const IPC_KV_Sweeper&) = delete;
+
+	void stop();
+private:
+	void run();
+
+	std::unique_ptr<IPC_KV> m_kv;
+	std::chrono::milliseconds m_interval;
+	size_t m_count;
+
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	bool m_is_stopping = false;
+
+	std::thread m_thread;
+};
+
+/**
+* Follows the changes made to a store from the moment it is created on,
+* without taking the lock, through the event ring of the store. The ring
+* only holds the last IPCKV_EVENTS events, so a watcher that falls further
+* behind misses some and has to look the store over again, see poll. The
+* store has to outlive the watcher. The shards of an IPC_KV_Sharded are
+* stores with rings of their own, which a watcher does not span.
+*/
+class IPC_KV_Watcher
+{
+public:
+	IPC_KV_Watcher(IPC_KV& kv);
+
+	/**
+	* Appends the events published since the last call to events, up to
+	* max_events of them. Returns false, and skips past every event published
+	* so far, if some were overwritten before they could be read, in which
+	* case the caller should read whatever it follows from the store again.
+	*/
+	bool poll(std::vector<IPC_KV_Event>& events, size_t max_events = IPCKV_EVENTS);
+
+	// Sleeps until there are events to poll or timeout has passed,
+	// and returns whether there are.
+	bool wait(std::chrono::milliseconds timeout);
+
+	// The hash a key is reported by.
+	static uint64_t hash(const std::string& key);
+private:
+	IPC_KV_Events* m_events;
+	IPC_Handle m_semaphore;
+
+	// Position of the next event to read.
+	uint64_t m_next;
+};
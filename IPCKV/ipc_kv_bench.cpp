@@ -0,0 +1,438 @@
+#include "ipc_kv.h"
+#include <chrono>
+#include <vector>
+#include <random>
+#include <cmath>
+
+#ifndef _WIN32
+#include <sys/wait.h>
+#endif
+
+/**
+* Store benchmark
+*
+* Forks reader and writer processes against one IPC_KV and reports their
+* throughput and latency percentiles as JSON. Readers only get, writers set
+* and, with --mix, also get that fraction of the time. Keys are picked
+* uniformly or by a Zipf distribution over --keys keys.
+*
+* By default every key is stored before the workers start, so the table does
+* not change size during the run. With --resize the store starts out empty
+* and the writers grow it, so the run spans its resizes.
+*
+* Usage: ipckv_bench [--readers N] [--writers N] [--seconds N] [--keys N]
+*                    [--key-size N] [--value-size N] [--zipf S] [--mix F]
+*                    [--resize]
+*/
+
+// Log-linear buckets, each power of two split into 2^IPCKV_BENCH_SUB_BITS.
+#define IPCKV_BENCH_SUB_BITS 4
+#define IPCKV_BENCH_BUCKETS (64 << IPCKV_BENCH_SUB_BITS)
+#define IPCKV_BENCH_PREFILL_BATCH 1024
+
+struct Bench_Config
+{
+	int m_readers = 4;
+	int m_writers = 1;
+	int m_seconds = 5;
+
+	size_t m_keys = 100000;
+	size_t m_key_size = 16;
+	size_t m_value_size = 64;
+
+	// Zipf exponent, zero for a uniform distribution.
+	double m_zipf = 0.0;
+
+	// Fraction of a writer's operations that are reads.
+	double m_mix = 0.0;
+
+	bool m_resize = false;
+};
+
+/**
+* Latencies in nanoseconds, with a relative error of 1 / 2^IPCKV_BENCH_SUB_BITS.
+*/
+struct Bench_Histogram
+{
+	uint64_t m_counts[IPCKV_BENCH_BUCKETS];
+	uint64_t m_total;
+
+	static size_t get_bucket(uint64_t value)
+	{
+		if (value < (1ull << IPCKV_BENCH_SUB_BITS))
+			return size_t(value);
+
+		int magnitude = 63;
+
+		while (!(value >> magnitude))
+			magnitude--;
+
+		auto shift = magnitude - IPCKV_BENCH_SUB_BITS;
+		auto sub = (value >> shift) & ((1ull << IPCKV_BENCH_SUB_BITS) - 1);
+
+		return size_t((shift + 1) << IPCKV_BENCH_SUB_BITS) + size_t(sub);
+	}
+
+	// The middle of the range of values in bucket.
+	static uint64_t get_value(size_t bucket)
+	{
+		if (bucket < (1ull << IPCKV_BENCH_SUB_BITS))
+			return bucket;
+
+		auto shift = (bucket >> IPCKV_BENCH_SUB_BITS) - 1;
+		auto sub = bucket & ((1ull << IPCKV_BENCH_SUB_BITS) - 1);
+		auto low = ((1ull << IPCKV_BENCH_SUB_BITS) | sub) << shift;
+
+		return low + ((1ull << shift) >> 1);
+	}
+
+	void record(uint64_t value)
+	{
+		m_counts[get_bucket(value)]++;
+		m_total++;
+	}
+
+	void merge(const Bench_Histogram& other)
+	{
+		for (size_t i = 0; i < IPCKV_BENCH_BUCKETS; i++)
+			m_counts[i] += other.m_counts[i];
+
+		m_total += other.m_total;
+	}
+
+	uint64_t get_percentile(double percentile) const
+	{
+		if (!m_total)
+			return 0;
+
+		auto rank = uint64_t(std::ceil(percentile / 100.0 * double(m_total)));
+		uint64_t seen = 0;
+
+		for (size_t i = 0; i < IPCKV_BENCH_BUCKETS; i++)
+		{
+			seen += m_counts[i];
+
+			if (seen >= rank && m_counts[i])
+				return get_value(i);
+		}
+
+		return 0;
+	}
+};
+
+/**
+* What each worker reports back, in memory shared with the parent.
+*/
+struct Bench_Worker
+{
+	Bench_Histogram m_reads;
+	Bench_Histogram m_writes;
+
+	uint64_t m_misses;
+	uint32_t m_failed;
+};
+
+struct Bench_Shared
+{
+	std::atomic<uint32_t> m_ready;
+	std::atomic<uint32_t> m_is_running;
+	std::atomic<uint32_t> m_is_stopped;
+};
+
+/**
+* Draws key indices, ranks of a Zipf distribution are looked up in its
+* cumulative distribution.
+*/
+class Bench_Key_Picker
+{
+public:
+	Bench_Key_Picker(size_t keys, double zipf) : m_keys(keys)
+	{
+		if (zipf <= 0.0)
+			return;
+
+		m_cdf.resize(keys);
+
+		double sum = 0.0;
+
+		for (size_t i = 0; i < keys; i++)
+		{
+			sum += 1.0 / std::pow(double(i + 1), zipf);
+			m_cdf[i] = sum;
+		}
+
+		for (auto& value : m_cdf)
+			value /= sum;
+	}
+
+	size_t pick(std::mt19937_64& random)
+	{
+		if (m_cdf.empty())
+			return size_t(random() % m_keys);
+
+		auto u = std::uniform_real_distribution<double>(0.0, 1.0)(random);
+		auto it = std::lower_bound(m_cdf.begin(), m_cdf.end(), u);
+
+		return std::min(size_t(it - m_cdf.begin()), m_keys - 1);
+	}
+private:
+	size_t m_keys;
+	std::vector<double> m_cdf;
+};
+
+static std::string make_key(size_t index, size_t key_size)
+{
+	auto key = std::to_string(index);
+
+	if (key.size() < key_size)
+		key.insert(0, key_size - key.size(), 'k');
+
+	return key;
+}
+
+static void run_worker(const Bench_Config& config, const std::string& name, bool is_writer, uint64_t seed,
+	const std::vector<std::string>& keys, Bench_Key_Picker& picker, Bench_Shared* shared, Bench_Worker* worker)
+{
+	std::mt19937_64 random(seed);
+	std::vector<unsigned char> value(config.m_value_size, (unsigned char)seed);
+	std::vector<unsigned char> buffer(config.m_value_size);
+
+	try
+	{
+		IPC_KV kv(name);
+
+		shared->m_ready++;
+
+		while (!shared->m_is_running.load())
+			ipc_cpu_relax();
+
+		while (!shared->m_is_stopped.load(std::memory_order_relaxed))
+		{
+			auto& key = keys[picker.pick(random)];
+			bool is_read = !is_writer || (config.m_mix > 0.0 && std::uniform_real_distribution<double>(0.0, 1.0)(random) < config.m_mix);
+
+			auto start = std::chrono::steady_clock::now();
+
+			if (is_read)
+			{
+				size_t size = buffer.size();
+
+				if (!kv.get(key, buffer.data(), size))
+					worker->m_misses++;
+			}
+			else
+			{
+				kv.set(key, value.data(), value.size());
+			}
+
+			auto elapsed = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+
+			if (is_read)
+				worker->m_reads.record(elapsed);
+			else
+				worker->m_writes.record(elapsed);
+		}
+	}
+	catch (std::runtime_error& ex)
+	{
+		fprintf(stderr, "Exception %s LastError %X\n", ex.what(), ipc_get_last_error());
+
+		worker->m_failed = 1;
+		shared->m_ready++;
+	}
+}
+
+static void print_histogram(const char* name, const Bench_Histogram& histogram, int seconds, bool is_last)
+{
+	printf("  \"%s\": { \"ops\": %llu, \"ops_per_sec\": %.0f, \"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu }%s\n",
+		name,
+		(unsigned long long)histogram.m_total,
+		double(histogram.m_total) / seconds,
+		(unsigned long long)histogram.get_percentile(50.0),
+		(unsigned long long)histogram.get_percentile(99.0),
+		(unsigned long long)histogram.get_percentile(99.9),
+		is_last ? "" : ","
+	);
+}
+
+static bool parse_arguments(int argc, char** argv, Bench_Config& config)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string argument = argv[i];
+
+		if (argument == "--resize")
+		{
+			config.m_resize = true;
+
+			continue;
+		}
+
+		if (i + 1 == argc)
+			return false;
+
+		auto value = argv[++i];
+
+		if (argument == "--readers")
+			config.m_readers = atoi(value);
+		else if (argument == "--writers")
+			config.m_writers = atoi(value);
+		else if (argument == "--seconds")
+			config.m_seconds = atoi(value);
+		else if (argument == "--keys")
+			config.m_keys = size_t(strtoull(value, nullptr, 10));
+		else if (argument == "--key-size")
+			config.m_key_size = size_t(strtoull(value, nullptr, 10));
+		else if (argument == "--value-size")
+			config.m_value_size = size_t(strtoull(value, nullptr, 10));
+		else if (argument == "--zipf")
+			config.m_zipf = atof(value);
+		else if (argument == "--mix")
+			config.m_mix = atof(value);
+		else
+			return false;
+	}
+
+	return config.m_readers >= 0 && config.m_writers >= 0 && config.m_readers + config.m_writers > 0
+		&& config.m_seconds > 0 && config.m_keys > 0 && config.m_key_size < IPCKV_KEY_SIZE - 1;
+}
+
+int main(int argc, char** argv)
+{
+	Bench_Config config;
+
+	if (!parse_arguments(argc, argv, config))
+	{
+		fprintf(stderr, "Usage: ipckv_bench [--readers N] [--writers N] [--seconds N] [--keys N] [--key-size N] [--value-size N] [--zipf S] [--mix F] [--resize]\n");
+
+		return 1;
+	}
+
+#ifdef _WIN32
+	fprintf(stderr, "ipckv_bench forks its workers and needs a POSIX system.\n");
+
+	return 1;
+#else
+	auto name = "ipckv_bench_" + std::to_string(ipc_get_process_id());
+	auto workers = config.m_readers + config.m_writers;
+
+	std::vector<std::string> keys;
+	keys.reserve(config.m_keys);
+
+	for (size_t i = 0; i < config.m_keys; i++)
+		keys.push_back(make_key(i, config.m_key_size));
+
+	Bench_Key_Picker picker(config.m_keys, config.m_zipf);
+
+	// Inherited by the workers, which write their results into it.
+	auto shared_size = sizeof(Bench_Shared) + sizeof(Bench_Worker) * workers;
+	auto shared_buffer = mmap(nullptr, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (shared_buffer == MAP_FAILED)
+	{
+		fprintf(stderr, "could not map shared results.\n");
+
+		return 1;
+	}
+
+	auto shared = (Bench_Shared*)shared_buffer;
+	auto results = (Bench_Worker*)(shared + 1);
+
+	try
+	{
+		// Keeps the store around for the whole run.
+		IPC_KV kv(name);
+
+		if (!config.m_resize)
+		{
+			std::vector<unsigned char> value(config.m_value_size);
+
+			for (size_t i = 0; i < keys.size(); i += IPCKV_BENCH_PREFILL_BATCH)
+			{
+				auto end = std::min(keys.size(), i + IPCKV_BENCH_PREFILL_BATCH);
+
+				std::vector<std::string> batch(keys.begin() + i, keys.begin() + end);
+				std::vector<std::string_view> values(batch.size(), std::string_view((const char*)value.data(), value.size()));
+
+				kv.multi_set(batch, values);
+			}
+		}
+
+		auto initial_size = kv.size();
+
+		std::vector<pid_t> children;
+
+		for (int i = 0; i < workers; i++)
+		{
+			auto pid = fork();
+
+			if (pid == -1)
+				throw std::runtime_error("could not fork.");
+
+			if (pid == 0)
+			{
+				run_worker(config, name, i >= config.m_readers, uint64_t(i) * 0x9E3779B97F4A7C15ull + 1, keys, picker, shared, &results[i]);
+
+				// Leaves the instance inherited from the parent attached.
+				_exit(0);
+			}
+
+			children.push_back(pid);
+		}
+
+		while (shared->m_ready.load() < uint32_t(workers))
+			ipc_sleep(1);
+
+		shared->m_is_running = 1;
+		ipc_sleep(config.m_seconds * 1000);
+		shared->m_is_stopped = 1;
+
+		for (auto pid : children)
+			waitpid(pid, nullptr, 0);
+
+		//////////////////////////////////////////////////
+
+		Bench_Histogram reads = {};
+		Bench_Histogram writes = {};
+		uint64_t misses = 0;
+		uint32_t failed = 0;
+
+		for (int i = 0; i < workers; i++)
+		{
+			reads.merge(results[i].m_reads);
+			writes.merge(results[i].m_writes);
+			misses += results[i].m_misses;
+			failed += results[i].m_failed;
+		}
+
+		printf("{\n");
+		printf("  \"config\": { \"readers\": %d, \"writers\": %d, \"seconds\": %d, \"keys\": %zu, \"key_size\": %zu, \"value_size\": %zu, \"distribution\": \"%s\", \"zipf\": %g, \"mix\": %g, \"resize\": %s },\n",
+			config.m_readers, config.m_writers, config.m_seconds, config.m_keys, config.m_key_size, config.m_value_size,
+			config.m_zipf > 0.0 ? "zipf" : "uniform", config.m_zipf, config.m_mix, config.m_resize ? "true" : "false");
+		printf("  \"ops_per_sec\": %.0f,\n", double(reads.m_total + writes.m_total) / config.m_seconds);
+		printf("  \"misses\": %llu,\n", (unsigned long long)misses);
+		printf("  \"failed_workers\": %u,\n", failed);
+		printf("  \"initial_size\": %zu,\n", initial_size);
+		printf("  \"final_size\": %zu,\n", kv.size());
+		print_histogram("reads", reads, config.m_seconds, false);
+		print_histogram("writes", writes, config.m_seconds, true);
+		printf("}\n");
+	}
+	catch (std::runtime_error& ex)
+	{
+		fprintf(stderr, "Exception %s LastError %X\n", ex.what(), ipc_get_last_error());
+
+		// Lets go of any workers still waiting for the start.
+		shared->m_is_stopped = 1;
+		shared->m_is_running = 1;
+
+		munmap(shared_buffer, shared_size);
+
+		return 1;
+	}
+
+	munmap(shared_buffer, shared_size);
+
+	return 0;
+#endif
+}
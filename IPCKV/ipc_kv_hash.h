@@ -0,0 +1,172 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#pragma intrinsic(_umul128)
+#endif
+
+/**
+* Hash policies
+*
+* A policy is a struct with a static hash function returning 64 bits and a
+* nonzero id. Every process attached to a store has to hash keys the same
+* way, so the id of the policy a store was created with is kept in its
+* info and processes built with another one are turned away.
+*
+* The policy in use is IPC_KV_Hash_Policy. To plug in another one, build the
+* library and everything using it with IPCKV_HASH_POLICY set to its name and
+* IPCKV_HASH_POLICY_HEADER to the header declaring it.
+*/
+
+/**
+* wyhash, final version 4, by Wang Yi, released into the public domain
+* (The Unlicense). https://github.com/wangyi-fudan/wyhash
+*
+* Vendored with the seed fixed to zero and unaligned reads done through
+* memcpy, which compilers turn into plain loads.
+*/
+namespace ipc_wyhash
+{
+	static const uint64_t secret[4] = {
+		0x2d358dccaa6c78a5ull,
+		0x8bb84b93962eacc9ull,
+		0x4b33a62ed433d4a3ull,
+		0x4d5a2da51de1aa47ull
+	};
+
+	inline void mum(uint64_t* a, uint64_t* b)
+	{
+#if defined(__SIZEOF_INT128__)
+		__uint128_t r = *a;
+		r *= *b;
+		*a = uint64_t(r);
+		*b = uint64_t(r >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+		*a = _umul128(*a, *b, b);
+#else
+		uint64_t ha = *a >> 32, hb = *b >> 32, la = uint32_t(*a), lb = uint32_t(*b);
+		uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+		uint64_t t = rl + (rm0 << 32), c = t < rl;
+		uint64_t lo = t + (rm1 << 32);
+
+		c += lo < t;
+
+		*a = lo;
+		*b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+	}
+
+	inline uint64_t mix(uint64_t a, uint64_t b)
+	{
+		mum(&a, &b);
+
+		return a ^ b;
+	}
+
+	inline uint64_t read8(const uint8_t* p)
+	{
+		uint64_t value;
+		std::memcpy(&value, p, 8);
+
+		return value;
+	}
+
+	inline uint64_t read4(const uint8_t* p)
+	{
+		uint32_t value;
+		std::memcpy(&value, p, 4);
+
+		return value;
+	}
+
+	inline uint64_t read3(const uint8_t* p, size_t k)
+	{
+		return (uint64_t(p[0]) << 16) | (uint64_t(p[k >> 1]) << 8) | p[k - 1];
+	}
+
+	inline uint64_t hash(const void* key, size_t length, uint64_t seed)
+	{
+		auto p = (const uint8_t*)key;
+		uint64_t a, b;
+
+		seed ^= mix(seed ^ secret[0], secret[1]);
+
+		if (length <= 16)
+		{
+			if (length >= 4)
+			{
+				a = (read4(p) << 32) | read4(p + ((length >> 3) << 2));
+				b = (read4(p + length - 4) << 32) | read4(p + length - 4 - ((length >> 3) << 2));
+			}
+			else if (length > 0)
+			{
+				a = read3(p, length);
+				b = 0;
+			}
+			else
+			{
+				a = b = 0;
+			}
+		}
+		else
+		{
+			size_t i = length;
+
+			if (i >= 48)
+			{
+				uint64_t see1 = seed, see2 = seed;
+
+				do
+				{
+					seed = mix(read8(p) ^ secret[1], read8(p + 8) ^ seed);
+					see1 = mix(read8(p + 16) ^ secret[2], read8(p + 24) ^ see1);
+					see2 = mix(read8(p + 32) ^ secret[3], read8(p + 40) ^ see2);
+					p += 48;
+					i -= 48;
+				} while (i >= 48);
+
+				seed ^= see1 ^ see2;
+			}
+
+			while (i > 16)
+			{
+				seed = mix(read8(p) ^ secret[1], read8(p + 8) ^ seed);
+				i -= 16;
+				p += 16;
+			}
+
+			a = read8(p + i - 16);
+			b = read8(p + i - 8);
+		}
+
+		a ^= secret[1];
+		b ^= seed;
+
+		mum(&a, &b);
+
+		return mix(a ^ secret[0] ^ length, b ^ secret[1]);
+	}
+}
+
+struct IPC_KV_Wyhash
+{
+	static constexpr uint32_t id = 1;
+
+	static uint64_t hash(const void* key, size_t size)
+	{
+		return ipc_wyhash::hash(key, size, 0);
+	}
+};
+
+#ifdef IPCKV_HASH_POLICY_HEADER
+#include IPCKV_HASH_POLICY_HEADER
+#endif
+
+#ifndef IPCKV_HASH_POLICY
+#define IPCKV_HASH_POLICY IPC_KV_Wyhash
+#endif
+
+typedef IPCKV_HASH_POLICY IPC_KV_Hash_Policy;
@@ -0,0 +1,127 @@
+#include "ipc_kv.h"
+
+/**
+* Store inspector
+*
+* Attaches to an existing store by name and reports how its table is laid
+* out, without holding the lock while it walks the slots. The read lock is
+* only taken for a moment on attaching and when the store was resized
+* meanwhile. It attaches as an observer, see IPC_KV_Options::m_is_observer,
+* so the store goes away with the last of its own instances as usual, and
+* a store left behind by a writer that died is not inspected until one of
+* them has recovered it.
+* Persistent stores are found by their --directory.
+*
+* Usage: ipckv_inspect <name> [--directory PATH] [--sample N | --dump]
+*/
+
+static void print_histogram(const char* name, const uint64_t* counts, size_t buckets)
+{
+	printf("%-16s", name);
+
+	for (size_t i = 0; i < buckets; i++)
+	{
+		if (!counts[i])
+			continue;
+
+		auto low = size_t(1) << i;
+
+		if (i == buckets - 1)
+			printf(" %zu+: %llu", low, (unsigned long long)counts[i]);
+		else if (low == 1)
+			printf(" 1: %llu", (unsigned long long)counts[i]);
+		else
+			printf(" %zu-%zu: %llu", low, low * 2 - 1, (unsigned long long)counts[i]);
+	}
+
+	printf("\n");
+}
+
+static void print_bytes(const char* name, size_t bytes)
+{
+	printf("%-16s%zu (%.1f MB)\n", name, bytes, double(bytes) / (1024.0 * 1024.0));
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: ipckv_inspect <name> [--directory PATH] [--sample N | --dump]\n");
+
+		return 1;
+	}
+
+	std::string name = argv[1];
+	std::string directory;
+	size_t key_samples = 0;
+
+	for (int i = 2; i < argc; i++)
+	{
+		std::string argument = argv[i];
+
+		if (argument == "--dump")
+		{
+			key_samples = SIZE_MAX;
+		}
+		else if (argument == "--sample" && i + 1 < argc)
+		{
+			key_samples = size_t(strtoull(argv[++i], nullptr, 10));
+		}
+		else if (argument == "--directory" && i + 1 < argc)
+		{
+			directory = argv[++i];
+		}
+		else
+		{
+			fprintf(stderr, "Usage: ipckv_inspect <name> [--directory PATH] [--sample N | --dump]\n");
+
+			return 1;
+		}
+	}
+
+	try
+	{
+		IPC_KV_Options options;
+		options.m_must_exist = true;
+		options.m_is_observer = true;
+		options.m_directory = directory;
+
+		IPC_KV kv(name, options);
+
+		auto inspection = kv.inspect(key_samples);
+
+		printf("%-16s%s\n", "store", name.c_str());
+		printf("%-16s%zu\n", "resize count", inspection.m_resize_count);
+		printf("%-16s%zu\n", "capacity", inspection.m_capacity);
+
+		if (inspection.m_old_capacity)
+			printf("%-16s%zu, still migrating\n", "old capacity", inspection.m_old_capacity);
+
+		printf("%-16s%zu\n", "size", inspection.m_size);
+		printf("%-16s%.3f\n", "load factor", inspection.m_load_factor);
+		printf("%-16s%zu\n", "occupied", inspection.m_occupied);
+		printf("%-16s%zu\n", "tombstones", inspection.m_tombstones);
+
+		print_histogram("probe distance", inspection.m_probe_distances, IPCKV_STATS_PROBE_BUCKETS);
+		printf("%-16s%zu groups\n", "max probe", inspection.m_max_probe_distance);
+
+		print_histogram("clusters", inspection.m_clusters, IPCKV_INSPECT_CLUSTER_BUCKETS);
+		printf("%-16s%zu slots\n", "max cluster", inspection.m_max_cluster);
+
+		print_bytes("info", inspection.m_info_bytes);
+		print_bytes("table", inspection.m_table_bytes);
+		print_bytes("heap", inspection.m_heap_bytes);
+		print_bytes("live values", inspection.m_live_bytes);
+
+		for (auto& key : inspection.m_keys)
+			printf("key %s\n", key.c_str());
+	}
+	catch (std::runtime_error& ex)
+	{
+		printf("Exception %s LastError %X\n", ex.what(), ipc_get_last_error());
+
+		return 1;
+	}
+
+	return 0;
+}
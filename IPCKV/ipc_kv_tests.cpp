@@ -0,0 +1,1206 @@
+#include "ipc_kv.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <set>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/wait.h>
+#endif
+
+/**
+* Tests
+*
+* Runs every test against stores named after the process, so that runs do
+* not see each other, and exits with the number of checks that failed.
+*
+* Usage: ipckv_tests
+*/
+
+static int failures = 0;
+
+#define CHECK(condition) \
+	do \
+	{ \
+		if (!(condition)) \
+		{ \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			failures++; \
+		} \
+	} while (0)
+
+static std::string get_store_name(const char* test)
+{
+	return std::string("tests_") + test + "_" + std::to_string(ipc_get_process_id());
+}
+
+static void set_string(IPC_KV& kv, const std::string& key, const std::string& value)
+{
+	kv.set(key, (unsigned char*)value.data(), value.size());
+}
+
+static bool get_string(IPC_KV& kv, const std::string& key, std::string& value)
+{
+	unsigned char buffer[256];
+	size_t size = sizeof(buffer);
+
+	if (!kv.get(key, buffer, size))
+		return false;
+
+	value.assign((const char*)buffer, size);
+
+	return true;
+}
+
+static bool has_value(IPC_KV& kv, const std::string& key, const std::string& expected)
+{
+	std::string value;
+
+	return get_string(kv, key, value) && value == expected;
+}
+
+//////////////////////////////////////////////////
+
+/**
+* Sets, overwrites and removes keys through two instances of one store,
+* which goes away with the last of them.
+*/
+static void test_basic()
+{
+	auto name = get_store_name("basic");
+
+	{
+		IPC_KV kv(name);
+		IPC_KV other(name);
+
+		set_string(kv, "key", "value");
+
+		CHECK(has_value(other, "key", "value"));
+		CHECK(other.size() == 1);
+
+		set_string(other, "key", "changed");
+
+		CHECK(has_value(kv, "key", "changed"));
+		CHECK(kv.size() == 1);
+
+		CHECK(kv.remove("key"));
+		CHECK(!kv.remove("key"));
+		CHECK(!has_value(other, "key", "changed"));
+		CHECK(other.size() == 0);
+
+		// Values too big for the buffer are not read.
+		std::string big(1000, 'x');
+		unsigned char buffer[16];
+		size_t size = sizeof(buffer);
+
+		set_string(kv, "big", big);
+
+		bool is_too_small = false;
+
+		try
+		{
+			kv.get("big", buffer, size);
+		}
+		catch (std::runtime_error&)
+		{
+			is_too_small = true;
+		}
+
+		CHECK(is_too_small);
+	}
+
+	IPC_KV_Options options;
+	options.m_must_exist = true;
+
+	bool does_exist = true;
+
+	try
+	{
+		IPC_KV kv(name, options);
+	}
+	catch (std::runtime_error&)
+	{
+		does_exist = false;
+	}
+
+	CHECK(!does_exist);
+}
+
+#ifndef _WIN32
+/**
+* A reader that dies holding the lock must not keep writers out. The store
+* is kept in directory, since a process that dies without closing keeps a
+* shared memory store around for good.
+*/
+static void test_dead_reader(const std::string& directory)
+{
+	IPC_KV_Options options;
+	options.m_directory = directory;
+
+	auto name = get_store_name("dead_reader");
+
+	IPC_KV kv(name, options);
+
+	set_string(kv, "key", "value");
+
+	auto pid = fork();
+
+	if (pid == 0)
+	{
+		IPC_KV child(name, options);
+		auto view = child.get_view("key");
+
+		pause();
+		_exit(0);
+	}
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+	kill(pid, SIGKILL);
+	waitpid(pid, nullptr, 0);
+
+	set_string(kv, "key", "changed");
+
+	CHECK(has_value(kv, "key", "changed"));
+}
+
+/**
+* A writer killed at some point of a run of sets, quite likely holding the
+* lock, leaves the store recovered for the next to take the lock.
+*/
+static void test_dead_writer(const std::string& directory)
+{
+	IPC_KV_Options options;
+	options.m_directory = directory;
+
+	auto name = get_store_name("dead_writer");
+
+	IPC_KV kv(name, options);
+
+	auto pid = fork();
+
+	if (pid == 0)
+	{
+		IPC_KV child(name, options);
+
+		for (int i = 0; ; i++)
+			set_string(child, "key" + std::to_string(i), "value" + std::to_string(i));
+	}
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+	kill(pid, SIGKILL);
+	waitpid(pid, nullptr, 0);
+
+	set_string(kv, "after", "after");
+
+	// The keys set make up a run from the first on.
+	size_t count = 0;
+
+	while (has_value(kv, "key" + std::to_string(count), "value" + std::to_string(count)))
+		count++;
+
+	CHECK(count > 0);
+	CHECK(kv.size() == count + 1);
+	CHECK(has_value(kv, "after", "after"));
+}
+#endif
+
+/**
+* Grows the table through several migrations while a second instance
+* reads along, and checks nothing goes missing on the way.
+*/
+static void test_resize()
+{
+	auto name = get_store_name("resize");
+
+	IPC_KV kv(name);
+	IPC_KV reader(name);
+
+	auto initial_capacity = kv.stats().m_capacity;
+
+	for (int i = 0; i < 20000; i++)
+	{
+		set_string(kv, "key" + std::to_string(i), "value" + std::to_string(i));
+
+		if (i % 97 == 0)
+			CHECK(has_value(reader, "key" + std::to_string(i / 2), "value" + std::to_string(i / 2)));
+	}
+
+	auto stats = kv.stats();
+
+	CHECK(stats.m_size == 20000);
+	CHECK(stats.m_capacity > initial_capacity);
+	CHECK(stats.m_resize_count > 0);
+
+	for (int i = 0; i < 20000; i++)
+		CHECK(has_value(reader, "key" + std::to_string(i), "value" + std::to_string(i)));
+
+	for (int i = 0; i < 20000; i += 2)
+		CHECK(kv.remove("key" + std::to_string(i)));
+
+	CHECK(reader.size() == 10000);
+	CHECK(!has_value(reader, "key0", "value0"));
+	CHECK(has_value(reader, "key1", "value1"));
+}
+
+/**
+* A view keeps the value it points at while it lives, and a writer from
+* another thread waits for it to go before changing the value.
+*/
+static void test_get_view()
+{
+	auto name = get_store_name("get_view");
+
+	IPC_KV kv(name);
+	IPC_KV writer(name);
+
+	set_string(kv, "key", "value");
+
+	CHECK(!kv.get_view("missing"));
+
+	std::atomic<bool> is_done(false);
+	std::thread thread;
+
+	{
+		auto view = kv.get_view("key");
+
+		CHECK(view);
+		CHECK(view.view() == "value");
+
+		thread = std::thread([&]
+		{
+			set_string(writer, "key", "changed");
+			is_done = true;
+		});
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+		CHECK(!is_done);
+		CHECK(view.view() == "value");
+	}
+
+	thread.join();
+
+	CHECK(is_done);
+	CHECK(kv.get_view("key").view() == "changed");
+}
+
+/**
+* Batches that overwrite, repeat and miss keys, and one big enough to grow
+* the table halfway, leave the size counting every key once.
+*/
+static void test_multi()
+{
+	auto name = get_store_name("multi");
+
+	IPC_KV kv(name);
+	IPC_KV other(name);
+
+	set_string(kv, "key0", "old");
+
+	std::vector<std::string> keys;
+	std::vector<std::string> values;
+
+	for (int i = 0; i < 5000; i++)
+	{
+		keys.push_back("key" + std::to_string(i));
+		values.push_back("value" + std::to_string(i));
+	}
+
+	// The last of a repeated key wins.
+	keys.push_back("key1");
+	values.push_back("again");
+
+	std::vector<std::string_view> views(values.begin(), values.end());
+
+	kv.multi_set(keys, views);
+
+	CHECK(other.size() == 5000);
+	CHECK(has_value(other, "key0", "value0"));
+	CHECK(has_value(other, "key1", "again"));
+	CHECK(has_value(other, "key4999", "value4999"));
+
+	std::vector<std::string> lookups = { "key2", "missing", "key3" };
+	std::vector<size_t> found;
+
+	auto count = other.multi_get(lookups, [&](size_t index, const unsigned char* data, size_t size)
+	{
+		CHECK(std::string((const char*)data, size) == "value" + lookups[index].substr(3));
+		found.push_back(index);
+	});
+
+	CHECK(count == 2);
+	CHECK(found == std::vector<size_t>({ 0, 2 }));
+
+	std::vector<std::string> removes = { "key0", "key0", "missing", "key4999" };
+
+	CHECK(other.multi_remove(removes) == 2);
+	CHECK(kv.size() == 4998);
+	CHECK(!has_value(kv, "key0", "value0"));
+
+	bool is_mismatched = false;
+
+	try
+	{
+		kv.multi_set({ "a", "b" }, { "a" });
+	}
+	catch (std::runtime_error&)
+	{
+		is_mismatched = true;
+	}
+
+	CHECK(is_mismatched);
+	CHECK(kv.size() == 4998);
+}
+
+/**
+* Keys spread over the shards read back through another instance, whose
+* shard count has to match, and ordered lookups merge the shards in order.
+*/
+static void test_sharded()
+{
+	auto name = get_store_name("sharded");
+
+	IPC_KV_Options options;
+	options.m_is_ordered = true;
+
+	IPC_KV_Sharded kv(name, 4, options);
+	IPC_KV_Sharded other(name, 4, options);
+
+	CHECK(kv.shard_count() == 4);
+
+	for (int i = 0; i < 1000; i++)
+	{
+		auto key = "key" + std::to_string(1000 + i);
+		auto value = "value" + std::to_string(i);
+
+		kv.set(key, (unsigned char*)value.data(), value.size());
+	}
+
+	CHECK(other.size() == 1000);
+	CHECK(other.stats().m_size == 1000);
+
+	unsigned char buffer[64];
+	size_t size = sizeof(buffer);
+
+	CHECK(other.get("key1500", buffer, size));
+	CHECK(std::string((const char*)buffer, size) == "value500");
+
+	CHECK(other.remove("key1500"));
+	CHECK(kv.size() == 999);
+
+	auto entries = other.range("key1100", "key1200", 50);
+
+	CHECK(entries.size() == 50);
+	CHECK(std::is_sorted(entries.begin(), entries.end()));
+	CHECK(entries.front().first == "key1100");
+	CHECK(entries.back().first == "key1149");
+
+	entries = other.prefix("key15");
+
+	CHECK(entries.size() == 99);
+	CHECK(std::is_sorted(entries.begin(), entries.end()));
+	CHECK(entries.front().first == "key1501");
+
+	bool is_mismatched = false;
+
+	try
+	{
+		IPC_KV_Sharded wrong(name, 8, options);
+	}
+	catch (std::runtime_error&)
+	{
+		is_mismatched = true;
+	}
+
+	CHECK(is_mismatched);
+
+	kv.clear();
+
+	CHECK(other.size() == 0);
+	CHECK(other.prefix("key").empty());
+}
+
+/**
+* Keeps a handful of keys while churning through many more, which leaves
+* tombstones behind that rebuilds have to clear without growing the table.
+*/
+static void test_tombstone_rebuild()
+{
+	IPC_KV kv(get_store_name("tombstones"));
+
+	auto initial_capacity = kv.stats().m_capacity;
+
+	for (int i = 0; i < 8; i++)
+		set_string(kv, "kept" + std::to_string(i), "kept");
+
+	for (int i = 0; i < 20000; i++)
+	{
+		set_string(kv, "churn" + std::to_string(i), "churn");
+		CHECK(kv.remove("churn" + std::to_string(i)));
+	}
+
+	auto stats = kv.stats();
+
+	CHECK(stats.m_size == 8);
+	CHECK(stats.m_capacity == initial_capacity);
+	CHECK(stats.m_resize_count > 0);
+	CHECK(stats.m_tombstones < stats.m_capacity);
+
+	for (int i = 0; i < 8; i++)
+		CHECK(has_value(kv, "kept" + std::to_string(i), "kept"));
+
+	CHECK(!has_value(kv, "churn0", "churn"));
+}
+
+/**
+* Clearing halfway through a migration drops both generations, and the
+* store grows from scratch again after.
+*/
+static void test_clear_migrating()
+{
+	auto name = get_store_name("clear_migrating");
+
+	IPC_KV kv(name);
+	IPC_KV other(name);
+
+	int count = 0;
+
+	while (kv.inspect().m_old_capacity == 0)
+	{
+		set_string(kv, "key" + std::to_string(count), "value");
+		count++;
+	}
+
+	CHECK(has_value(other, "key0", "value"));
+
+	other.clear();
+
+	auto inspection = kv.inspect();
+
+	CHECK(inspection.m_size == 0);
+	CHECK(inspection.m_old_capacity == 0);
+	CHECK(inspection.m_occupied == 0);
+	CHECK(kv.size() == 0);
+
+	for (int i = 0; i < count; i++)
+		CHECK(!has_value(kv, "key" + std::to_string(i), "value"));
+
+	for (int i = 0; i < 2 * count; i++)
+		set_string(kv, "again" + std::to_string(i), "again");
+
+	CHECK(other.size() == size_t(2 * count));
+
+	for (int i = 0; i < 2 * count; i++)
+		CHECK(has_value(other, "again" + std::to_string(i), "again"));
+}
+
+/**
+* Counts kept per instance add up in stats, also after an instance closed,
+* and inspect sees the same table.
+*/
+static void test_stats()
+{
+	auto name = get_store_name("stats");
+
+	IPC_KV kv(name);
+	auto other = std::make_unique<IPC_KV>(name);
+
+	CHECK(kv.stats().m_instances == 2);
+
+	for (int i = 0; i < 100; i++)
+		set_string(kv, "key" + std::to_string(i), "value");
+
+	for (int i = 0; i < 10; i++)
+		set_string(kv, "key" + std::to_string(i), "changed");
+
+	for (int i = 0; i < 50; i++)
+		CHECK(has_value(*other, "key" + std::to_string(i), i < 10 ? "changed" : "value"));
+
+	for (int i = 0; i < 5; i++)
+		CHECK(!has_value(*other, "missing" + std::to_string(i), "value"));
+
+	CHECK(other->remove("key99"));
+	CHECK(!other->remove("key99"));
+
+	auto stats = kv.stats();
+
+	CHECK(stats.m_sets == 110);
+	CHECK(stats.m_gets == 55);
+	CHECK(stats.m_hits == 50);
+	CHECK(stats.m_misses == 5);
+	CHECK(stats.m_removes == 2);
+	CHECK(stats.m_locks >= 110 + 2);
+	CHECK(stats.hit_ratio() > 0.9 && stats.hit_ratio() < 0.91);
+	CHECK(stats.m_size == 99);
+
+	uint64_t probes = 0;
+
+	for (auto count : stats.m_probes)
+		probes += count;
+
+	CHECK(probes > 0);
+
+	auto inspection = kv.inspect(10);
+
+	CHECK(inspection.m_size == 99);
+	CHECK(inspection.m_capacity == stats.m_capacity);
+	CHECK(inspection.m_occupied == 99);
+	CHECK(inspection.m_tombstones == stats.m_tombstones);
+	CHECK(inspection.m_live_bytes == stats.m_live_bytes);
+	CHECK(inspection.m_keys.size() >= 9 && inspection.m_keys.size() <= 10);
+
+	other.reset();
+
+	stats = kv.stats();
+
+	CHECK(stats.m_instances == 1);
+	CHECK(stats.m_gets == 55);
+}
+
+/**
+* An observer reads a store without counting as attached to it, so the
+* store goes away when its last own instance closes.
+*/
+static void test_observer(const std::string& directory)
+{
+	auto name = get_store_name("observer");
+
+	IPC_KV_Options observer_options;
+	observer_options.m_is_observer = true;
+
+	{
+		auto kv = std::make_unique<IPC_KV>(name);
+
+		set_string(*kv, "key", "value");
+
+		auto instances = kv->stats().m_instances;
+
+		IPC_KV observer(name, observer_options);
+
+		CHECK(has_value(observer, "key", "value"));
+		CHECK(observer.stats().m_instances == instances);
+
+		observer.close();
+
+		CHECK(has_value(*kv, "key", "value"));
+
+		// Attached while the store goes away.
+		IPC_KV second_observer(name, observer_options);
+
+		kv.reset();
+	}
+
+	bool does_exist = true;
+
+	try
+	{
+		IPC_KV observer(name, observer_options);
+	}
+	catch (std::runtime_error&)
+	{
+		does_exist = false;
+	}
+
+	CHECK(!does_exist);
+
+	// Persistent stores are found in their directory.
+	IPC_KV_Options options;
+	options.m_directory = directory;
+
+	{
+		IPC_KV kv(name, options);
+
+		set_string(kv, "key", "value");
+	}
+
+	observer_options.m_directory = directory;
+
+	IPC_KV observer(name, observer_options);
+
+	CHECK(has_value(observer, "key", "value"));
+	CHECK(observer.inspect().m_size == 1);
+
+#ifndef _WIN32
+	// Left to the store's own instances to recover after a writer died.
+	auto abandoned_name = get_store_name("observer_abandoned");
+
+	IPC_KV kv(abandoned_name, options);
+
+	auto pid = fork();
+
+	if (pid == 0)
+	{
+		IPC_KV child(abandoned_name, options);
+
+		std::vector<std::string> keys;
+		std::vector<std::string_view> values;
+
+		for (int i = 0; i < 1000000; i++)
+		{
+			keys.push_back("key" + std::to_string(i));
+			values.push_back("value");
+		}
+
+		child.multi_set(keys, values);
+		_exit(0);
+	}
+
+	// The batch commits the size before every resize, so from the
+	// first on the child is halfway through it with the lock held.
+	while (kv.size() == 0)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	kill(pid, SIGKILL);
+	waitpid(pid, nullptr, 0);
+
+	bool is_abandoned = false;
+
+	try
+	{
+		IPC_KV abandoned_observer(abandoned_name, observer_options);
+	}
+	catch (std::runtime_error&)
+	{
+		is_abandoned = true;
+	}
+
+	CHECK(is_abandoned);
+
+	set_string(kv, "after", "after");
+
+	IPC_KV recovered_observer(abandoned_name, observer_options);
+
+	CHECK(has_value(recovered_observer, "after", "after"));
+	CHECK(recovered_observer.size() == kv.size());
+#endif
+}
+
+/**
+* A store kept in files outlives its instances and reopens with its keys,
+* removes included.
+*/
+static void test_persistence(const std::string& directory)
+{
+	IPC_KV_Options options;
+	options.m_directory = directory;
+
+	auto name = get_store_name("persistence");
+
+	{
+		IPC_KV kv(name, options);
+
+		for (int i = 0; i < 5000; i++)
+			set_string(kv, "key" + std::to_string(i), "value" + std::to_string(i));
+
+		kv.remove("key0");
+	}
+
+	{
+		IPC_KV kv(name, options);
+
+		CHECK(kv.size() == 4999);
+		CHECK(!has_value(kv, "key0", "value0"));
+
+		for (int i = 1; i < 5000; i++)
+			CHECK(has_value(kv, "key" + std::to_string(i), "value" + std::to_string(i)));
+
+		set_string(kv, "key0", "again");
+	}
+
+	{
+		IPC_KV kv(name, options);
+
+		CHECK(kv.size() == 5000);
+		CHECK(has_value(kv, "key0", "again"));
+
+		kv.clear();
+	}
+}
+
+/**
+* A snapshot loads back into the store it came from, replacing what is
+* there, and into a cache too small for it.
+*/
+
+static void test_snapshot(const std::string& directory)
+{
+	auto path = directory + "/snapshot.bin";
+
+	IPC_KV kv(get_store_name("snapshot"));
+
+	for (int i = 0; i < 5000; i++)
+		set_string(kv, "key" + std::to_string(i), std::string(size_t(i % 200), char('a' + i % 26)));
+
+	kv.snapshot(path);
+
+	// Loading replaces whatever is there.
+	kv.clear();
+	set_string(kv, "stray", "stray");
+
+	kv.load(path);
+
+	CHECK(kv.size() == 5000);
+	CHECK(!has_value(kv, "stray", "stray"));
+
+	for (int i = 0; i < 5000; i++)
+		CHECK(has_value(kv, "key" + std::to_string(i), std::string(size_t(i % 200), char('a' + i % 26))));
+
+	// A cache takes a snapshot too big for it up to its limit, in the
+	// table it was sized for.
+	IPC_KV_Options options;
+	options.m_max_entries = 1000;
+
+	IPC_KV cache(get_store_name("snapshot_cache"), options);
+
+	auto capacity = cache.stats().m_capacity;
+
+	cache.load(path);
+
+	CHECK(cache.size() == 1000);
+	CHECK(cache.stats().m_capacity == capacity);
+	CHECK(has_value(cache, "key4999", std::string(size_t(4999 % 200), char('a' + 4999 % 26))));
+
+	std::filesystem::remove(path);
+}
+
+/**
+* A scan that a resize and its migration overtake halfway still returns
+* every key that was there throughout.
+*/
+static void test_scan_migrating()
+{
+	auto name = get_store_name("scan_migrating");
+
+	IPC_KV kv(name);
+	IPC_KV writer(name);
+
+	for (int i = 0; i < 1000; i++)
+		set_string(kv, "key" + std::to_string(i), "value");
+
+	auto resize_count = kv.stats().m_resize_count;
+
+	std::set<std::string> found;
+	IPC_KV_Cursor cursor;
+	int added = 0;
+	bool was_migrating = false;
+
+	while (!cursor.is_done())
+	{
+		for (auto& entry : kv.scan(cursor, 50))
+		{
+			CHECK(entry.second == "value");
+			found.insert(entry.first);
+		}
+
+		// Enough to resize and keep migrating while the scan goes on,
+		// but not so many the table outgrows the scan for good.
+		for (int i = 0; i < 20 && added < 4000; i++, added++)
+			set_string(writer, "added" + std::to_string(added), "value");
+
+		was_migrating = was_migrating || kv.inspect().m_old_capacity != 0;
+	}
+
+	CHECK(kv.stats().m_resize_count > resize_count);
+	CHECK(was_migrating);
+
+	for (int i = 0; i < 1000; i++)
+		CHECK(found.count("key" + std::to_string(i)) == 1);
+}
+
+/**
+* The ordered index follows sets, overwrites, removes and clears, also
+* while a migration is moving the keys it points at.
+*/
+static void test_ordered()
+{
+	auto name = get_store_name("ordered");
+
+	IPC_KV_Options options;
+	options.m_is_ordered = true;
+
+	IPC_KV kv(name, options);
+	IPC_KV other(name);
+
+	std::map<std::string, std::string> expected;
+
+	auto set_expected = [&](const std::string& key, const std::string& value) {
+		set_string(kv, key, value);
+		expected[key] = value;
+	};
+
+	auto get_expected = [&](const std::string& begin, const std::string& end, size_t limit) {
+		std::vector<std::pair<std::string, std::string>> entries;
+
+		for (auto it = expected.lower_bound(begin); it != expected.end() && it->first < end && entries.size() < limit; ++it)
+			entries.push_back(*it);
+
+		return entries;
+	};
+
+	for (int i = 0; i < 500; i++)
+		set_expected("key" + std::to_string(1000 + i), "value");
+
+	CHECK(other.range("key1100", "key1200") == get_expected("key1100", "key1200", SIZE_MAX));
+	CHECK(other.range("key1100", "key1200", 10) == get_expected("key1100", "key1200", 10));
+	CHECK(other.range("key2", "key3").empty());
+
+	set_expected("key1150", "changed");
+	CHECK(kv.remove("key1151"));
+	expected.erase("key1151");
+
+	CHECK(other.range("key1100", "key1200") == get_expected("key1100", "key1200", SIZE_MAX));
+	CHECK(other.prefix("key115") == get_expected("key115", "key116", SIZE_MAX));
+
+	// Keep going until a resize has come and gone, checking while it migrates.
+	auto resize_count = kv.stats().m_resize_count;
+	int added = 0;
+	int migrating_checks = 0;
+
+	while (kv.stats().m_resize_count == resize_count || kv.inspect().m_old_capacity != 0)
+	{
+		set_expected("added" + std::to_string(10000 + added), "added");
+		added++;
+
+		if (kv.inspect().m_old_capacity != 0)
+		{
+			CHECK(other.prefix("key11") == get_expected("key11", "key12", SIZE_MAX));
+			CHECK(other.prefix("added", 20) == get_expected("added", "addee", 20));
+			migrating_checks++;
+		}
+	}
+
+	CHECK(migrating_checks > 0);
+
+	CHECK(other.range("", "\x7f") == get_expected("", "\x7f", SIZE_MAX));
+
+	other.clear();
+	expected.clear();
+
+	CHECK(kv.prefix("key").empty());
+
+	set_expected("key0", "again");
+
+	CHECK(other.prefix("key") == get_expected("key", "kez", SIZE_MAX));
+}
+
+/**
+* Keys set with a time to live read as gone once it ran out, and are
+* swept from the size.
+*/
+static void test_ttl()
+{
+	using namespace std::chrono_literals;
+
+	IPC_KV kv(get_store_name("ttl"));
+
+	std::string value = "value";
+
+	kv.set("short", (unsigned char*)value.data(), value.size(), 50ms);
+	kv.set("long", (unsigned char*)value.data(), value.size(), 60s);
+	set_string(kv, "forever", value);
+
+	CHECK(has_value(kv, "short", value));
+
+	std::this_thread::sleep_for(100ms);
+
+	CHECK(!has_value(kv, "short", value));
+	CHECK(has_value(kv, "long", value));
+	CHECK(has_value(kv, "forever", value));
+
+	// Expired keys count towards the size until they are swept.
+	CHECK(kv.sweep(SIZE_MAX) == 1);
+	CHECK(kv.size() == 2);
+	CHECK(kv.stats().m_expirations == 1);
+
+	// Setting a key again without a ttl keeps it for good.
+	kv.set("renewed", (unsigned char*)value.data(), value.size(), 50ms);
+	set_string(kv, "renewed", "again");
+
+	std::this_thread::sleep_for(100ms);
+
+	CHECK(has_value(kv, "renewed", "again"));
+}
+
+/**
+* A full cache evicts keys nobody read for every new one, and while it is
+* rebuilt it evicts those not migrated yet before any written since.
+*/
+
+static void test_cache_eviction()
+{
+	IPC_KV_Options options;
+	options.m_max_entries = 100;
+
+	IPC_KV kv(get_store_name("cache"), options);
+
+	for (int i = 0; i < 100; i++)
+		set_string(kv, "key" + std::to_string(i), "value");
+
+	CHECK(kv.size() == 100);
+	CHECK(kv.stats().m_evictions == 0);
+
+	// Overwriting a key makes no room.
+	set_string(kv, "key0", "changed");
+
+	CHECK(kv.stats().m_evictions == 0);
+	CHECK(has_value(kv, "key0", "changed"));
+
+	for (int i = 100; i < 1000; i++)
+	{
+		set_string(kv, "key" + std::to_string(i), "value");
+
+		// Read every time, so the CLOCK always passes it over.
+		CHECK(has_value(kv, "key0", "changed"));
+	}
+
+	auto stats = kv.stats();
+
+	CHECK(stats.m_size == 100);
+	CHECK(stats.m_evictions == 900);
+	CHECK(has_value(kv, "key999", "value"));
+	CHECK(!has_value(kv, "key1", "value"));
+
+	// The key that starts the rebuild and those after it.
+	std::vector<std::string> keys;
+
+	for (int i = 0; kv.inspect().m_old_capacity == 0; i++)
+	{
+		keys = { "fill" + std::to_string(i) };
+		set_string(kv, keys.back(), "value");
+	}
+
+	for (int i = 0; i < 20 && kv.inspect().m_old_capacity != 0; i++)
+	{
+		keys.push_back("rebuilding" + std::to_string(i));
+		set_string(kv, keys.back(), "value");
+	}
+
+	CHECK(keys.size() > 1);
+
+	for (auto& key : keys)
+		CHECK(has_value(kv, key, "value"));
+}
+
+/**
+* A watcher reads the events of a store in the order they were published,
+* tells when it fell too far behind, and wakes up on a write made through
+* another instance.
+*/
+static void test_watcher()
+{
+	auto name = get_store_name("watcher");
+
+	IPC_KV kv(name);
+	IPC_KV other(name);
+
+	IPC_KV_Watcher watcher(other);
+	std::vector<IPC_KV_Event> events;
+
+	CHECK(watcher.poll(events));
+	CHECK(events.empty());
+
+	set_string(kv, "a", "value");
+	set_string(kv, "b", "value");
+	CHECK(kv.remove("a"));
+	kv.clear();
+
+	CHECK(watcher.poll(events));
+	CHECK(events.size() == 4);
+
+	if (events.size() == 4)
+	{
+		CHECK(events[0].m_type == EventSet && events[0].m_hash == IPC_KV_Watcher::hash("a"));
+		CHECK(events[1].m_type == EventSet && events[1].m_hash == IPC_KV_Watcher::hash("b"));
+		CHECK(events[2].m_type == EventRemove && events[2].m_hash == IPC_KV_Watcher::hash("a"));
+		CHECK(events[3].m_type == EventClear && events[3].m_hash == 0);
+
+		for (size_t i = 1; i < events.size(); i++)
+			CHECK(events[i].m_version == events[i - 1].m_version + 1);
+	}
+
+	set_string(kv, "c", "value");
+
+	unsigned char buffer[16];
+	size_t size = sizeof(buffer);
+	uint64_t version = 0;
+
+	events.clear();
+
+	CHECK(watcher.poll(events));
+	CHECK(events.size() == 1);
+	CHECK(other.get("c", buffer, size, version));
+	CHECK(!events.empty() && events.back().m_version == version);
+
+	// Falling behind by more than the ring holds skips past all of it.
+	for (int i = 0; i < IPCKV_EVENTS + 1; i++)
+		set_string(kv, "key" + std::to_string(i), "value");
+
+	events.clear();
+
+	CHECK(!watcher.poll(events));
+	CHECK(watcher.poll(events));
+	CHECK(events.empty());
+
+	CHECK(!watcher.wait(std::chrono::milliseconds(10)));
+
+	auto start = std::chrono::steady_clock::now();
+
+	std::thread thread([&]
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		set_string(kv, "woken", "value");
+	});
+
+	CHECK(watcher.wait(std::chrono::seconds(10)));
+	CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+
+	thread.join();
+
+	CHECK(watcher.poll(events));
+	CHECK(events.size() == 1);
+	CHECK(!events.empty() && events.back().m_hash == IPC_KV_Watcher::hash("woken"));
+}
+
+/**
+* Conditional writes go through only for the version or absence they
+* expect, versions only ever go up, and counters added to from two
+* instances at once lose no increments.
+*/
+static void test_conditional()
+{
+	using namespace std::chrono_literals;
+
+	auto name = get_store_name("conditional");
+
+	IPC_KV kv(name);
+	IPC_KV other(name);
+
+	std::string value = "value";
+	std::string changed = "changed";
+
+	auto first = kv.set_if_absent("key", (unsigned char*)value.data(), value.size());
+
+	CHECK(first != 0);
+	CHECK(other.set_if_absent("key", (unsigned char*)changed.data(), changed.size()) == 0);
+	CHECK(has_value(other, "key", "value"));
+
+	auto second = other.compare_and_set("key", first, (unsigned char*)changed.data(), changed.size());
+
+	CHECK(second > first);
+	CHECK(has_value(kv, "key", "changed"));
+
+	// The version it was read at is stale now.
+	CHECK(kv.compare_and_set("key", first, (unsigned char*)value.data(), value.size()) == 0);
+	CHECK(has_value(kv, "key", "changed"));
+
+	unsigned char buffer[16];
+	size_t size = sizeof(buffer);
+	uint64_t version = 0;
+
+	CHECK(kv.get("key", buffer, size, version));
+	CHECK(version == second);
+
+	// Zero expects the key to be missing, and versions keep going up
+	// after it was removed and set again.
+	CHECK(kv.compare_and_set("key", 0, (unsigned char*)value.data(), value.size()) == 0);
+	CHECK(kv.remove("key"));
+
+	auto third = kv.compare_and_set("key", 0, (unsigned char*)value.data(), value.size());
+
+	CHECK(third > second);
+
+	CHECK(kv.fetch_add("counter", 5) == 0);
+	CHECK(other.fetch_add("counter", -2) == 5);
+
+	// Adding keeps the time to live of the key.
+	int64_t start = 10;
+
+	kv.set("expiring", (unsigned char*)&start, sizeof(start), 100ms);
+
+	CHECK(kv.fetch_add("expiring", 1) == 10);
+
+	std::this_thread::sleep_for(200ms);
+
+	CHECK(kv.fetch_add("expiring", 1) == 0);
+	CHECK(kv.fetch_add("expiring", 0) == 1);
+
+	std::thread thread([&]
+	{
+		for (int i = 0; i < 1000; i++)
+			other.fetch_add("shared", 1);
+	});
+
+	for (int i = 0; i < 1000; i++)
+		kv.fetch_add("shared", 1);
+
+	thread.join();
+
+	CHECK(kv.fetch_add("shared", 0) == 2000);
+}
+
+//////////////////////////////////////////////////
+
+int main()
+{
+	auto directory = (std::filesystem::temp_directory_path() / get_store_name("files")).string();
+
+	std::filesystem::create_directories(directory);
+
+	struct Test
+	{
+		const char* m_name;
+		std::function<void()> m_run;
+	};
+
+	Test tests[] = {
+		{ "basic", test_basic },
+#ifndef _WIN32
+		{ "dead_reader", [&] { test_dead_reader(directory); } },
+		{ "dead_writer", [&] { test_dead_writer(directory); } },
+#endif
+		{ "resize", test_resize },
+		{ "get_view", test_get_view },
+		{ "multi", test_multi },
+		{ "sharded", test_sharded },
+		{ "tombstone_rebuild", test_tombstone_rebuild },
+		{ "clear_migrating", test_clear_migrating },
+		{ "stats", test_stats },
+		{ "observer", [&] { test_observer(directory); } },
+		{ "persistence", [&] { test_persistence(directory); } },
+		{ "snapshot", [&] { test_snapshot(directory); } },
+		{ "scan_migrating", test_scan_migrating },
+		{ "ordered", test_ordered },
+		{ "ttl", test_ttl },
+		{ "cache_eviction", test_cache_eviction },
+		{ "watcher", test_watcher },
+		{ "conditional", test_conditional },
+	};
+
+	for (auto& test : tests)
+	{
+		auto before = failures;
+
+		try
+		{
+			test.m_run();
+		}
+		catch (std::runtime_error& ex)
+		{
+			fprintf(stderr, "%s: exception: %s\n", test.m_name, ex.what());
+			failures++;
+		}
+
+		printf("%-20s%s\n", test.m_name, failures == before ? "ok" : "FAILED");
+	}
+
+	std::filesystem::remove_all(directory);
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,275 @@
+#include "ipc_kv.h"
+#include <chrono>
+#include <vector>
+#include <thread>
+
+#ifndef _WIN32
+#include <semaphore.h>
+#endif
+
+/**
+* Lock contention benchmark
+*
+* Runs reader and writer threads against IPC_RW_Lock and against the
+* semaphore scheme IPC_Lock used to be built on: a named semaphore with
+* IPCKV_SEMAPHORE_TOKENS tokens, drained one at a time by writers under
+* a named mutex, with the kernel objects opened on every acquisition.
+*
+* Usage: ipckv_lock_bench [readers] [writers] [seconds]
+*/
+
+#define IPCKV_SEMAPHORE_TOKENS 24
+#define IPCKV_BENCH_CACHE_LINES 4
+
+#ifdef _WIN32
+typedef HANDLE Bench_Semaphore;
+#else
+typedef sem_t* Bench_Semaphore;
+#endif
+
+static Bench_Semaphore open_semaphore(const std::string& name, unsigned int initial_count, unsigned int maximum_count, bool& does_already_exist)
+{
+#ifdef _WIN32
+	auto semaphore = CreateSemaphoreA(nullptr, initial_count, maximum_count, name.c_str());
+
+	does_already_exist = GetLastError() == ERROR_ALREADY_EXISTS;
+
+	return semaphore;
+#else
+	// POSIX semaphores have no maximum of their own, only SEM_VALUE_MAX.
+	if (initial_count > maximum_count || maximum_count > SEM_VALUE_MAX)
+		throw std::runtime_error("invalid semaphore count.");
+
+	auto object_name = "/" + name;
+
+	does_already_exist = false;
+
+	auto semaphore = sem_open(object_name.c_str(), O_CREAT | O_EXCL, 0666, initial_count);
+
+	if (semaphore == SEM_FAILED && errno == EEXIST)
+	{
+		does_already_exist = true;
+
+		semaphore = sem_open(object_name.c_str(), 0);
+	}
+
+	if (semaphore == SEM_FAILED)
+		throw std::runtime_error("could not create semaphore.");
+
+	return semaphore;
+#endif
+}
+
+static void wait_semaphore(Bench_Semaphore semaphore)
+{
+#ifdef _WIN32
+	WaitForSingleObject(semaphore, INFINITE);
+#else
+	while (sem_wait(semaphore) == -1 && errno == EINTR);
+#endif
+}
+
+static void release_semaphore(Bench_Semaphore semaphore, unsigned int count)
+{
+#ifdef _WIN32
+	ReleaseSemaphore(semaphore, count, nullptr);
+#else
+	for (unsigned int i = 0; i < count; i++)
+		sem_post(semaphore);
+#endif
+}
+
+static void close_semaphore(Bench_Semaphore semaphore)
+{
+#ifdef _WIN32
+	CloseHandle(semaphore);
+#else
+	sem_close(semaphore);
+#endif
+}
+
+static void unlink_semaphore(const std::string& name)
+{
+#ifndef _WIN32
+	sem_unlink(("/" + name).c_str());
+#endif
+}
+
+class Semaphore_Lock
+{
+public:
+	Semaphore_Lock(bool is_write_lock, const std::string& name)
+	{
+		bool does_already_exist;
+
+		if (is_write_lock)
+		{
+			mutex = open_semaphore(name + "_mutex", 1, 1, does_already_exist);
+			wait_semaphore(mutex);
+
+			semaphore = open_semaphore(name, 0, IPCKV_SEMAPHORE_TOKENS, does_already_exist);
+
+			if (does_already_exist)
+			{
+				for (int i = 0; i < IPCKV_SEMAPHORE_TOKENS; i++)
+					wait_semaphore(semaphore);
+			}
+
+			release_count = IPCKV_SEMAPHORE_TOKENS;
+		}
+		else
+		{
+			semaphore = open_semaphore(name, IPCKV_SEMAPHORE_TOKENS, IPCKV_SEMAPHORE_TOKENS, does_already_exist);
+			wait_semaphore(semaphore);
+
+			release_count = 1;
+		}
+	}
+
+	Semaphore_Lock(const Semaphore_Lock&) = delete;
+	Semaphore_Lock& operator=(const Semaphore_Lock&) = delete;
+
+	~Semaphore_Lock()
+	{
+		release_semaphore(semaphore, release_count);
+		close_semaphore(semaphore);
+
+		if (mutex)
+		{
+			release_semaphore(mutex, 1);
+			close_semaphore(mutex);
+		}
+	}
+private:
+	Bench_Semaphore semaphore = nullptr;
+	Bench_Semaphore mutex = nullptr;
+
+	unsigned int release_count = 0;
+};
+
+/**
+* The protected data, a few cache lines readers scan and writers bump.
+*/
+struct Bench_Data
+{
+	alignas(64) uint64_t m_values[IPCKV_BENCH_CACHE_LINES * 8];
+};
+
+struct Bench_Result
+{
+	uint64_t m_reads = 0;
+	uint64_t m_writes = 0;
+};
+
+template <typename Lock_Factory>
+static Bench_Result run(int readers, int writers, int seconds, Bench_Data* data, Lock_Factory make_lock)
+{
+	std::atomic<bool> is_running{ true };
+	std::vector<std::thread> threads;
+	std::vector<uint64_t> counts(readers + writers);
+
+	for (int i = 0; i < readers + writers; i++)
+	{
+		threads.emplace_back([&, i]() {
+			bool is_writer = i >= readers;
+			uint64_t count = 0;
+			volatile uint64_t sink = 0;
+
+			while (is_running.load(std::memory_order_relaxed))
+			{
+				auto lock = make_lock(is_writer);
+
+				for (auto& value : data->m_values)
+				{
+					if (is_writer)
+						value++;
+					else
+						sink = sink + value;
+				}
+
+				count++;
+			}
+
+			counts[i] = count;
+		});
+	}
+
+	ipc_sleep(seconds * 1000);
+	is_running = false;
+
+	for (auto& thread : threads)
+		thread.join();
+
+	Bench_Result result;
+
+	for (int i = 0; i < readers + writers; i++)
+	{
+		if (i < readers)
+			result.m_reads += counts[i];
+		else
+			result.m_writes += counts[i];
+	}
+
+	return result;
+}
+
+static void report(const char* name, const Bench_Result& result, int seconds)
+{
+	printf("%-10s reads/s %12.0f  writes/s %10.0f\n",
+		name,
+		double(result.m_reads) / seconds,
+		double(result.m_writes) / seconds
+	);
+}
+
+int main(int argc, char** argv)
+{
+	int readers = argc > 1 ? atoi(argv[1]) : 32;
+	int writers = argc > 2 ? atoi(argv[2]) : 1;
+	int seconds = argc > 3 ? atoi(argv[3]) : 2;
+
+	auto name = "ipckv_lock_bench_" + std::to_string(ipc_get_process_id());
+
+	printf("%d readers, %d writers, %d seconds\n", readers, writers, seconds);
+
+	try
+	{
+		IPC_Handle handle;
+		bool does_already_exist;
+
+		auto buffer = ipc_map_shared_memory(name, sizeof(IPC_RW_Lock) + sizeof(Bench_Data), handle, does_already_exist);
+
+		if (buffer == nullptr)
+			throw std::runtime_error("could not map view of file.");
+
+		auto rw_lock = (IPC_RW_Lock*)buffer;
+		auto data = (Bench_Data*)(rw_lock + 1);
+
+		auto rw_result = run(readers, writers, seconds, data, [&](bool is_writer) {
+			return IPC_Lock(is_writer, rw_lock);
+		});
+
+		report("IPC_Lock", rw_result, seconds);
+
+		auto semaphore_result = run(readers, writers, seconds, data, [&](bool is_writer) {
+			return Semaphore_Lock(is_writer, name);
+		});
+
+		report("Semaphore", semaphore_result, seconds);
+
+		ipc_unmap_shared_memory(buffer, sizeof(IPC_RW_Lock) + sizeof(Bench_Data));
+		ipc_close_handle(handle);
+		ipc_unlink_shared_memory(name);
+
+		unlink_semaphore(name);
+		unlink_semaphore(name + "_mutex");
+	}
+	catch (std::runtime_error& ex)
+	{
+		printf("Exception %s LastError %X\n", ex.what(), ipc_get_last_error());
+
+		return 1;
+	}
+
+	return 0;
+}
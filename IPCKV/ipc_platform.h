@@ -0,0 +1,591 @@
+#pragma once
+#ifdef _WIN32
+#include <Windows.h>
+#include <intrin.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#endif
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include <string>
+#include <cstdint>
+#include <cstdio>
+#include <climits>
+#include <atomic>
+
+/**
+* Platform layer
+*
+* Everything that talks to the operating system goes through here so that
+* IPC_KV itself only deals with plain pointers and handles.
+*/
+
+#ifdef _WIN32
+typedef HANDLE IPC_Handle;
+
+#define IPCKV_INVALID_HANDLE nullptr
+#define IPCKV_MAX_PATH MAX_PATH
+#else
+typedef int IPC_Handle;
+
+#define IPCKV_INVALID_HANDLE -1
+#define IPCKV_MAX_PATH NAME_MAX
+#endif
+
+// How long an opener waits for the creator of a segment to size it.
+#define IPCKV_MAP_RETRIES 1000
+
+/**
+* Miscellaneous
+*/
+
+inline uint32_t ipc_get_process_id()
+{
+#ifdef _WIN32
+	return GetCurrentProcessId();
+#else
+	// getpid is a system call and the lock asks on every read,
+	// so keep it until a fork changes it.
+	static std::atomic<uint32_t> process_id = { 0 };
+	static int is_registered = pthread_atfork(nullptr, nullptr, [] { process_id.store(0, std::memory_order_relaxed); });
+
+	(void)is_registered;
+
+	auto id = process_id.load(std::memory_order_relaxed);
+
+	if (id == 0)
+	{
+		id = uint32_t(getpid());
+		process_id.store(id, std::memory_order_relaxed);
+	}
+
+	return id;
+#endif
+}
+
+inline uint32_t ipc_get_last_error()
+{
+#ifdef _WIN32
+	return GetLastError();
+#else
+	return uint32_t(errno);
+#endif
+}
+
+/**
+* Returns false once the process has exited. Process ids get reused,
+* so a true answer may be about another process.
+*/
+inline bool ipc_is_process_alive(uint32_t process_id)
+{
+#ifdef _WIN32
+	auto process = OpenProcess(SYNCHRONIZE, FALSE, process_id);
+
+	if (process == NULL)
+		return GetLastError() == ERROR_ACCESS_DENIED;
+
+	auto is_alive = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+
+	CloseHandle(process);
+
+	return is_alive;
+#else
+	return kill(pid_t(process_id), 0) == 0 || errno == EPERM;
+#endif
+}
+
+inline void ipc_sleep(uint32_t milliseconds)
+{
+#ifdef _WIN32
+	Sleep(milliseconds);
+#else
+	timespec duration;
+
+	duration.tv_sec = milliseconds / 1000;
+	duration.tv_nsec = long(milliseconds % 1000) * 1000000;
+
+	while (nanosleep(&duration, &duration) == -1 && errno == EINTR);
+#endif
+}
+
+/**
+* Index of the lowest set bit, value must not be zero.
+*/
+inline uint32_t ipc_count_trailing_zeros(uint32_t value)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+
+	_BitScanForward(&index, value);
+
+	return uint32_t(index);
+#else
+	return uint32_t(__builtin_ctz(value));
+#endif
+}
+
+/**
+* Hints that address is about to be read.
+*/
+inline void ipc_prefetch(const void* address)
+{
+#ifdef _MSC_VER
+	_mm_prefetch((const char*)address, _MM_HINT_T0);
+#else
+	__builtin_prefetch(address);
+#endif
+}
+
+/**
+* Shared Memory
+*/
+
+#ifndef _WIN32
+inline std::string ipc_object_name(const std::string& name)
+{
+	return "/" + name;
+}
+#endif
+
+/**
+* Opens the segment, creating it unless can_create is false, in which
+* case nullptr is returned if it does not exist.
+*/
+inline void* ipc_map_shared_memory(const std::string& name, size_t size, IPC_Handle& handle, bool& does_already_exist, bool can_create = true)
+{
+#ifdef _WIN32
+	HANDLE mapping_handle;
+
+	if (can_create)
+	{
+		mapping_handle = CreateFileMapping(
+			INVALID_HANDLE_VALUE,
+			NULL,
+			PAGE_READWRITE,
+			DWORD(uint64_t(size) >> 32),
+			DWORD(size),
+			name.c_str()
+		);
+
+		does_already_exist = GetLastError() == ERROR_ALREADY_EXISTS;
+	}
+	else
+	{
+		mapping_handle = OpenFileMapping(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+
+		does_already_exist = true;
+	}
+
+	if (mapping_handle == NULL)
+		return nullptr;
+
+	auto buffer = MapViewOfFile(
+		mapping_handle,
+		FILE_MAP_ALL_ACCESS,
+		0,
+		0,
+		size
+	);
+
+	if (buffer == NULL)
+	{
+		CloseHandle(mapping_handle);
+
+		return nullptr;
+	}
+
+	handle = mapping_handle;
+
+	return buffer;
+#else
+	auto object_name = ipc_object_name(name);
+
+	does_already_exist = false;
+
+	int fd = can_create ? shm_open(object_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666) : -1;
+
+	if (!can_create || (fd == -1 && errno == EEXIST))
+	{
+		does_already_exist = true;
+
+		fd = shm_open(object_name.c_str(), O_RDWR, 0666);
+	}
+
+	if (fd == -1)
+		return nullptr;
+
+	if (!does_already_exist)
+	{
+		if (ftruncate(fd, off_t(size)) == -1)
+		{
+			close(fd);
+			shm_unlink(object_name.c_str());
+
+			return nullptr;
+		}
+	}
+	else
+	{
+		// The creator might not have sized the object yet.
+		struct stat file_stat;
+
+		for (int i = 0; ; i++)
+		{
+			if (fstat(fd, &file_stat) == -1 || i == IPCKV_MAP_RETRIES)
+			{
+				close(fd);
+
+				return nullptr;
+			}
+
+			if (size_t(file_stat.st_size) >= size)
+				break;
+
+			ipc_sleep(1);
+		}
+	}
+
+	auto buffer = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (buffer == MAP_FAILED)
+	{
+		close(fd);
+
+		return nullptr;
+	}
+
+	handle = fd;
+
+	return buffer;
+#endif
+}
+
+inline void ipc_unmap_shared_memory(void* buffer, size_t size)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(buffer);
+#else
+	munmap(buffer, size);
+#endif
+}
+
+inline void ipc_close_handle(IPC_Handle handle)
+{
+#ifdef _WIN32
+	CloseHandle(handle);
+#else
+	close(handle);
+#endif
+}
+
+/**
+* Windows destroys a mapping once its last handle is closed, POSIX
+* keeps it around until it is unlinked.
+*/
+inline void ipc_unlink_shared_memory(const std::string& name)
+{
+#ifndef _WIN32
+	shm_unlink(ipc_object_name(name).c_str());
+#endif
+}
+
+/**
+* Files
+*
+* Persistent stores keep their segments in files, which are mapped the same
+* way and outlive every process. A file that has never been sized counts as
+* new, so one left behind half created is simply set up again.
+*/
+
+inline void* ipc_map_file(const std::string& path, size_t size, IPC_Handle& handle, bool& does_already_exist, bool can_create = true)
+{
+#ifdef _WIN32
+	auto file = CreateFileA(
+		path.c_str(),
+		GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL,
+		can_create ? OPEN_ALWAYS : OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL
+	);
+
+	if (file == INVALID_HANDLE_VALUE)
+		return nullptr;
+
+	LARGE_INTEGER file_size;
+
+	does_already_exist = GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0;
+
+	auto mapping_handle = CreateFileMapping(
+		file,
+		NULL,
+		PAGE_READWRITE,
+		DWORD(uint64_t(size) >> 32),
+		DWORD(size),
+		NULL
+	);
+
+	// The mapping keeps the file open.
+	CloseHandle(file);
+
+	if (mapping_handle == NULL)
+		return nullptr;
+
+	auto buffer = MapViewOfFile(
+		mapping_handle,
+		FILE_MAP_ALL_ACCESS,
+		0,
+		0,
+		size
+	);
+
+	if (buffer == NULL)
+	{
+		CloseHandle(mapping_handle);
+
+		return nullptr;
+	}
+
+	handle = mapping_handle;
+
+	return buffer;
+#else
+	int fd = open(path.c_str(), O_RDWR | (can_create ? O_CREAT : 0), 0666);
+
+	if (fd == -1)
+		return nullptr;
+
+	struct stat file_stat;
+
+	if (fstat(fd, &file_stat) == -1)
+	{
+		close(fd);
+
+		return nullptr;
+	}
+
+	does_already_exist = file_stat.st_size > 0;
+
+	if (size_t(file_stat.st_size) < size && ftruncate(fd, off_t(size)) == -1)
+	{
+		close(fd);
+
+		return nullptr;
+	}
+
+	auto buffer = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (buffer == MAP_FAILED)
+	{
+		close(fd);
+
+		return nullptr;
+	}
+
+	handle = fd;
+
+	return buffer;
+#endif
+}
+
+/**
+* Windows refuses to delete a file that is still mapped, in which case
+* it is left behind.
+*/
+inline void ipc_unlink_file(const std::string& path)
+{
+#ifdef _WIN32
+	DeleteFileA(path.c_str());
+#else
+	unlink(path.c_str());
+#endif
+}
+
+/**
+* Opens a file for stdio, nullptr if it cannot be opened.
+*/
+inline FILE* ipc_open_file(const std::string& path, const char* mode)
+{
+#ifdef _WIN32
+	FILE* file = nullptr;
+
+	return fopen_s(&file, path.c_str(), mode) == 0 ? file : nullptr;
+#else
+	return fopen(path.c_str(), mode);
+#endif
+}
+
+/**
+* Writes the dirty pages of a file mapping back to the file.
+*/
+inline void ipc_flush_mapping(void* buffer, size_t size)
+{
+#ifdef _WIN32
+	FlushViewOfFile(buffer, size);
+#else
+	msync(buffer, size, MS_SYNC);
+#endif
+}
+
+/**
+* Advisory locks on a file, held per handle and dropped by the system
+* when the process holding them dies.
+*/
+inline IPC_Handle ipc_open_lock_file(const std::string& path)
+{
+#ifdef _WIN32
+	auto handle = CreateFileA(
+		path.c_str(),
+		GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL,
+		OPEN_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL
+	);
+
+	return handle == INVALID_HANDLE_VALUE ? IPCKV_INVALID_HANDLE : handle;
+#else
+	return open(path.c_str(), O_RDWR | O_CREAT, 0666);
+#endif
+}
+
+inline bool ipc_lock_file(IPC_Handle handle, bool is_exclusive, bool should_wait)
+{
+#ifdef _WIN32
+	OVERLAPPED overlapped = {};
+	DWORD flags = (is_exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0) | (should_wait ? 0 : LOCKFILE_FAIL_IMMEDIATELY);
+
+	return LockFileEx(handle, flags, 0, 1, 0, &overlapped) != 0;
+#else
+	int operation = (is_exclusive ? LOCK_EX : LOCK_SH) | (should_wait ? 0 : LOCK_NB);
+	int result;
+
+	while ((result = flock(handle, operation)) == -1 && errno == EINTR);
+
+	return result == 0;
+#endif
+}
+
+inline void ipc_unlock_file(IPC_Handle handle)
+{
+#ifdef _WIN32
+	OVERLAPPED overlapped = {};
+
+	UnlockFileEx(handle, 0, 1, 0, &overlapped);
+#else
+	flock(handle, LOCK_UN);
+#endif
+}
+
+/**
+* Returns true if the object behind the handle has been unlinked
+* by another process since it was opened.
+*/
+inline bool ipc_is_unlinked(IPC_Handle handle)
+{
+#ifdef _WIN32
+	return false;
+#else
+	struct stat file_stat;
+
+	return fstat(handle, &file_stat) == -1 || file_stat.st_nlink == 0;
+#endif
+}
+
+/**
+* Futexes
+*
+* Waits until the word no longer holds the expected value, for at most
+* timeout_ms milliseconds. Windows has no cross-process futex (WaitOnAddress
+* is process-local), so there waiters sleep on a named semaphore standing in
+* for every word of a store, see ipc_open_semaphore, which wakers release
+* once per sleeper. Sleepers woken for another word look again and go back
+* to sleep. Without a semaphore, or on other platforms without futexes,
+* waiters sleep a millisecond at a time.
+*/
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex words must be plain 32-bit integers.");
+
+inline IPC_Handle ipc_open_semaphore(const std::string& name)
+{
+#ifdef _WIN32
+	return CreateSemaphoreA(nullptr, 0, LONG_MAX, name.c_str());
+#else
+	(void)name;
+
+	return IPCKV_INVALID_HANDLE;
+#endif
+}
+
+inline void ipc_futex_wait(std::atomic<uint32_t>* address, uint32_t expected, uint32_t timeout_ms, IPC_Handle semaphore = IPCKV_INVALID_HANDLE)
+{
+#if defined(__linux__)
+	(void)semaphore;
+
+	timespec timeout;
+	timeout.tv_sec = time_t(timeout_ms / 1000);
+	timeout.tv_nsec = long(timeout_ms % 1000) * 1000000;
+
+	syscall(SYS_futex, (uint32_t*)address, FUTEX_WAIT, expected, &timeout, nullptr, 0);
+#elif defined(_WIN32)
+	if (address->load() != expected)
+		return;
+
+	if (semaphore != IPCKV_INVALID_HANDLE)
+		WaitForSingleObject(semaphore, timeout_ms);
+	else
+		Sleep(timeout_ms < 1 ? timeout_ms : 1);
+#else
+	(void)semaphore;
+
+	if (address->load() == expected)
+		ipc_sleep(timeout_ms < 1 ? timeout_ms : 1);
+#endif
+}
+
+// Wakes up to count waiters.
+inline void ipc_futex_wake(std::atomic<uint32_t>* address, uint32_t count, IPC_Handle semaphore = IPCKV_INVALID_HANDLE)
+{
+#if defined(__linux__)
+	(void)semaphore;
+
+	syscall(SYS_futex, (uint32_t*)address, FUTEX_WAKE, count < INT_MAX ? int(count) : INT_MAX, nullptr, nullptr, 0);
+#elif defined(_WIN32)
+	(void)address;
+
+	if (semaphore != IPCKV_INVALID_HANDLE && count > 0)
+		ReleaseSemaphore(semaphore, count < LONG_MAX ? LONG(count) : LONG_MAX, nullptr);
+#else
+	(void)address;
+	(void)count;
+	(void)semaphore;
+#endif
+}
+
+/**
+* Spin hint for busy-wait loops.
+*/
+inline void ipc_cpu_relax()
+{
+#if defined(_MSC_VER)
+	YieldProcessor();
+#elif defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	asm volatile("yield");
+#endif
+}